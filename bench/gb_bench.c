@@ -0,0 +1,224 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "frame_pacer.h"
+#include "joypad.h"
+#include "json.h"
+#include "movie.h"
+#include "profile.h"
+
+#define DEFAULT_FRAMES  3600        //A minute of emulated time
+#define DEFAULT_RUNS    3
+#define MAX_WORKLOADS   64
+
+//A rom, optionally played with a movie's input
+typedef struct Workload {
+	const char* name;				//As given on the command line
+	char rom_path[4096];
+	const char* movie_path;
+	Rom* rom;
+	Movie movie;
+	bool has_movie;
+} Workload;
+
+typedef struct RunResult {
+	uint64_t nanoseconds;			//Only the emulation, not the frame hashing
+	uint64_t instructions;
+	uint64_t frame_hash;
+	uint64_t reused_lines;
+	uint64_t apu_edges;
+	uint64_t apu_samples;
+	Profile profile;
+} RunResult;
+
+static void print_usage(const char* program) {
+	printf("Usage: %s [options] workload...\n", program);
+	printf("Runs each workload from power on with no video or sound output and reports\n");
+	printf("how fast it went. A workload is a rom, or rom:movie to play it with a movie's input\n");
+	printf("  --frames N   Frames per run, default %d\n", DEFAULT_FRAMES);
+	printf("  --runs N     Timed runs per workload, the fastest is reported, default %d\n", DEFAULT_RUNS);
+	printf("  --json       Print the results as JSON instead\n");
+}
+
+static bool open_workload(Workload* workload, const char* name) {
+	workload->name = name;
+	snprintf(workload->rom_path, sizeof(workload->rom_path), "%s", name);
+	workload->movie_path = NULL;
+	workload->has_movie = false;
+	char* separator = strrchr(workload->rom_path, ':');
+	if (separator != NULL) {
+		*separator = '\0';
+		workload->movie_path = name + (separator - workload->rom_path) + 1;
+	}
+
+	workload->rom = rom_open(workload->rom_path);
+	if (workload->rom == NULL) {
+		printf("Could not open %s\n", workload->rom_path);
+		return false;
+	}
+	if (workload->movie_path != NULL) {
+		if (!movie_load(&workload->movie, workload->movie_path))
+			return false;
+		workload->has_movie = true;
+	}
+	return true;
+}
+
+static void run_workload(Workload* workload, int frames, bool profiled, RunResult* result) {
+	memset(result, 0, sizeof(RunResult));
+	Cpu* cpu = malloc(sizeof(Cpu));
+	if (cpu == NULL) {
+		printf("Could not allocate cpu\n");
+		exit(1);
+	}
+	reset_cpu(cpu);
+	load_rom(cpu, workload->rom);
+	cpu->pc = 0x100;
+	if (workload->has_movie && !movie_start(&workload->movie, cpu))
+		exit(1);
+	if (profiled)
+		set_profile(cpu, &result->profile);
+
+	result->frame_hash = FNV1A_64_INIT;
+	int16_t samples[1024 * 2];
+	for (int frame = 0; frame < frames; frame++) {
+		//Past the end of a movie nothing is held
+		uint8_t buttons = 0;
+		if (workload->has_movie && (uint32_t)frame < workload->movie.frame_count)
+			buttons = workload->movie.inputs[frame];
+
+		uint64_t start = pacer_now();
+		if (joypad_set_buttons(&cpu->joypad, buttons))
+			cpu->interrupt_flags |= JOYPAD_RST60;
+		bool finished = run_frame(cpu);
+		//Drained as the emulator does, taking samples out is part of the cost
+		while (apu_read_samples(&cpu->apu, samples, 1024) > 0)
+			;
+		result->nanoseconds += pacer_now() - start;
+
+		if (finished)
+			result->reused_lines += cpu->gpu.last_frame_reused_lines;
+		result->frame_hash = fnv1a_64(result->frame_hash, cpu->gpu.framebuffer->data, SCREEN_WIDTH * SCREEN_HEIGHT);
+	}
+	result->instructions = cpu->instructions;
+	result->apu_edges = cpu->apu.edges;
+	result->apu_samples = cpu->apu.samples_made;
+	release_cpu(cpu);
+	free(cpu);
+}
+
+//Share of the profiled run's time, as ns per frame
+static double section_ns(const RunResult* run, int section, int frames) {
+	return (double)run->profile.nanoseconds[section] / frames;
+}
+
+static void print_result(const Workload* workload, int frames, int runs, const RunResult* best, const RunResult* profiled) {
+	double seconds = best->nanoseconds / 1e9;
+	double fps = frames / seconds;
+	double total = (double)profiled->nanoseconds / frames;
+	double render = section_ns(profiled, PROFILE_RENDER, frames);
+	double apu = section_ns(profiled, PROFILE_APU, frames);
+	double cpu = total - render - apu;
+
+	printf("%s, %d frames, best of %d\n", workload->name, frames, runs);
+	printf("  %.1f fps (%.2fx real time), %.0f ns/frame, %.2f MIPS\n",
+		fps, fps * FRAME_NANOSECONDS / 1e9, (double)best->nanoseconds / frames, best->instructions / seconds / 1e6);
+	printf("  profiled run, includes timer overhead: %.0f ns/frame\n", total);
+	printf("    cpu     %10.0f ns/frame %5.1f%%  (%" PRIu64 " instructions)\n", cpu, cpu / total * 100, profiled->instructions);
+	printf("    render  %10.0f ns/frame %5.1f%%  (%" PRIu64 " lines drawn, %" PRIu64 " reused)\n",
+		render, render / total * 100, profiled->profile.calls[PROFILE_RENDER] - profiled->reused_lines, profiled->reused_lines);
+	printf("    apu     %10.0f ns/frame %5.1f%%  (%" PRIu64 " edges, %" PRIu64 " samples)\n",
+		apu, apu / total * 100, profiled->apu_edges, profiled->apu_samples);
+	printf("  frame hash %016" PRIx64 "\n", best->frame_hash);
+}
+
+static void print_json_result(const Workload* workload, int frames, const RunResult* best, const RunResult* profiled, bool last) {
+	double seconds = best->nanoseconds / 1e9;
+	double fps = frames / seconds;
+	double total = (double)profiled->nanoseconds / frames;
+	double render = section_ns(profiled, PROFILE_RENDER, frames);
+	double apu = section_ns(profiled, PROFILE_APU, frames);
+
+	printf("    {\n");
+	printf("      \"name\": ");
+	print_json_string(workload->name);
+	printf(",\n");
+	printf("      \"seconds\": %.6f,\n", seconds);
+	printf("      \"fps\": %.2f,\n", fps);
+	printf("      \"realtime\": %.3f,\n", fps * FRAME_NANOSECONDS / 1e9);
+	printf("      \"ns_per_frame\": %.0f,\n", (double)best->nanoseconds / frames);
+	printf("      \"mips\": %.3f,\n", best->instructions / seconds / 1e6);
+	printf("      \"instructions\": %" PRIu64 ",\n", best->instructions);
+	printf("      \"frame_hash\": \"%016" PRIx64 "\",\n", best->frame_hash);
+	//From the profiled run, so it adds up to that run's time rather than ns_per_frame
+	printf("      \"breakdown\": {\n");
+	printf("        \"profiled_ns_per_frame\": %.0f,\n", total);
+	printf("        \"cpu_ns_per_frame\": %.0f,\n", total - render - apu);
+	printf("        \"render_ns_per_frame\": %.0f,\n", render);
+	printf("        \"apu_ns_per_frame\": %.0f,\n", apu);
+	printf("        \"lines_drawn\": %" PRIu64 ",\n", profiled->profile.calls[PROFILE_RENDER] - profiled->reused_lines);
+	printf("        \"lines_reused\": %" PRIu64 ",\n", profiled->reused_lines);
+	printf("        \"apu_edges\": %" PRIu64 ",\n", profiled->apu_edges);
+	printf("        \"apu_samples\": %" PRIu64 "\n", profiled->apu_samples);
+	printf("      }\n");
+	printf("    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char** argv) {
+	int frames = DEFAULT_FRAMES;
+	int runs = DEFAULT_RUNS;
+	bool json = false;
+	static Workload workloads[MAX_WORKLOADS];
+	int workload_count = 0;
+	for (int arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--frames") == 0 && arg + 1 < argc) {
+			frames = atoi(argv[++arg]);
+		} else if (strcmp(argv[arg], "--runs") == 0 && arg + 1 < argc) {
+			runs = atoi(argv[++arg]);
+		} else if (strcmp(argv[arg], "--json") == 0) {
+			json = true;
+		} else if (argv[arg][0] == '-' || workload_count == MAX_WORKLOADS) {
+			print_usage(argv[0]);
+			return 1;
+		} else if (!open_workload(&workloads[workload_count++], argv[arg])) {
+			return 1;
+		}
+	}
+	if (workload_count == 0 || frames <= 0 || runs <= 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if (json)
+		printf("{\n  \"frames\": %d,\n  \"runs\": %d,\n  \"workloads\": [\n", frames, runs);
+	for (int i = 0; i < workload_count; i++) {
+		Workload* workload = &workloads[i];
+		//Headline numbers come from unprofiled runs so the timing calls don't skew them.
+		//The breakdown comes from one extra profiled run and is shown against its own total
+		RunResult best = { 0 }, run, profiled;
+		for (int r = 0; r < runs; r++) {
+			run_workload(workload, frames, false, &run);
+			if (r > 0 && run.frame_hash != best.frame_hash)
+				fprintf(stderr, "%s: run %d gave different frames, emulation isn't deterministic\n", workload->name, r + 1);
+			if (r == 0 || run.nanoseconds < best.nanoseconds)
+				best = run;
+		}
+		run_workload(workload, frames, true, &profiled);
+
+		if (json)
+			print_json_result(workload, frames, &best, &profiled, i == workload_count - 1);
+		else
+			print_result(workload, frames, runs, &best, &profiled);
+
+		if (workload->has_movie)
+			movie_free(&workload->movie);
+		rom_release(workload->rom);
+	}
+	if (json)
+		printf("  ]\n}\n");
+	return 0;
+}
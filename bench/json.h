@@ -0,0 +1,16 @@
+#pragma once
+#include <stdio.h>
+
+//Prints string as a quoted JSON string, so paths with quotes, backslashes or control characters stay valid
+static inline void print_json_string(const char* string) {
+	putchar('"');
+	for (const unsigned char* c = (const unsigned char*)string; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\')
+			printf("\\%c", *c);
+		else if (*c < 0x20)
+			printf("\\u%04x", *c);
+		else
+			putchar(*c);
+	}
+	putchar('"');
+}
@@ -0,0 +1,496 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cartridge.h"
+#include "cpu.h"
+#include "frame_pacer.h"
+#include "json.h"
+#include "memory.h"
+
+#define DEFAULT_ITERATIONS  100000
+#define REPEATS             3           //Each timing is the best of this many, to ride out the odd interruption
+#define WARM_UP             1000
+#define SLOWEST_SHOWN       10
+#define CODE_ADDRESS        0xC000      //Opcodes are run from wram, operands follow them
+#define AUDIO_WARM_UP       12000       //Samples the output high pass is left to settle before a tone is measured
+#define AUDIO_TONES         7
+#define AUDIBLE_LIMIT       20000       //Hz, aliases above this are reported but don't count towards the worst case
+
+/*
+ * Registers every handler starts from, chosen so that anything they
+ * point at is ordinary memory: BC, DE and HL are in wram, 16 bit
+ * operands are 0xC890 and 8 bit ones 0x90 (hram for LDH).
+ * Flags are clear, so NZ and NC branches are taken and Z and C ones aren't.
+ */
+typedef struct Registers {
+	uint8_t a, f, b, c, d, e, h, l;
+	uint16_t sp, pc;
+} Registers;
+
+static const Registers start_registers = {
+	.a = 0x5A, .f = 0x00,
+	.b = 0xC9, .c = 0x10,
+	.d = 0xCA, .e = 0x20,
+	.h = 0xC8, .l = 0x30,
+	.sp = 0xDFF0, .pc = CODE_ADDRESS + 1
+};
+
+static const uint8_t operands[] = { 0x90, 0xC8 };
+
+typedef struct MemoryRegion {
+	const char* name;
+	uint16_t address;
+	uint16_t span;				//Accesses cycle through this many addresses from address
+	bool write;
+} MemoryRegion;
+
+static const MemoryRegion memory_regions[] = {
+	{ "rom bank 0", 0x0150, 0x100, false },
+	{ "rom bank n", 0x4000, 0x100, false },
+	{ "vram tiles", 0x8000, 0x100, false },
+	{ "vram map", 0x9800, 0x100, false },
+	{ "cart ram", 0xA000, 0x100, false },
+	{ "wram", 0xC000, 0x100, false },
+	{ "wram bank 1", 0xD000, 0x100, false },
+	{ "echo ram", 0xE000, 0x100, false },
+	{ "oam", 0xFE00, 0xA0, false },
+	{ "joypad", 0xFF00, 1, false },
+	{ "div", 0xFF04, 1, false },
+	{ "nr12", 0xFF12, 1, false },
+	{ "nr52", 0xFF26, 1, false },
+	{ "ly", 0xFF44, 1, false },
+	{ "hram", 0xFF80, 0x7F, false },
+	{ "ie", 0xFFFF, 1, false },
+	{ "mbc rom bank", 0x2000, 1, true },
+	{ "vram tiles", 0x8000, 0x100, true },
+	{ "vram map", 0x9800, 0x100, true },
+	{ "cart ram", 0xA000, 0x100, true },
+	{ "wram", 0xC000, 0x100, true },
+	{ "wram bank 1", 0xD000, 0x100, true },
+	{ "echo ram", 0xE000, 0x100, true },
+	{ "oam", 0xFE00, 0xA0, true },
+	{ "joypad", 0xFF00, 1, true },
+	{ "tima", 0xFF05, 1, true },
+	{ "nr12", 0xFF12, 1, true },
+	{ "scx", 0xFF43, 1, true },
+	{ "bgp", 0xFF47, 1, true },
+	{ "hram", 0xFF80, 0x7F, true },
+};
+#define NUM_MEMORY_REGIONS (int)(sizeof(memory_regions) / sizeof(memory_regions[0]))
+
+/*
+ * Square wave periods for the audio measurement, in 32 clock units (2048 minus
+ * the channel's frequency register), 256Hz - 16kHz. All are powers of 2 so each
+ * tone repeats a whole number of times in a second, which is exactly
+ * APU_SAMPLE_RATE samples, and every harmonic and every alias lands on its own
+ * DFT bin with nothing leaking between them.
+ */
+static const int tone_periods[AUDIO_TONES] = { 512, 256, 128, 64, 32, 16, 8 };
+
+typedef struct ToneResult {
+	int frequency;					//Hz
+	double aliasing;				//Energy of aliases below AUDIBLE_LIMIT against the energy on the tone's harmonics, dB
+	double all_aliasing;			//The same for everything off the harmonics, up to nyquist
+	double ns_per_second;			//apu_sync time per second of sound
+} ToneResult;
+
+static bool hit_unimplemented;
+
+static void note_unimplemented(uint8_t opcode) {
+	(void)opcode;
+	hit_unimplemented = true;
+}
+
+static void print_usage(const char* program) {
+	printf("Usage: %s [options]\n", program);
+	printf("Times every opcode handler and the memory read and write paths in isolation,\n");
+	printf("then measures how much aliasing the sound output adds to a sweep of square waves\n");
+	printf("  --iterations N   Executions per timing, default %d\n", DEFAULT_ITERATIONS);
+	printf("  --json           Print the results as JSON instead\n");
+}
+
+//An MBC5 cart with 8 rom banks and 4 ram banks, so bank switching and cartridge ram take their real paths
+static Rom* make_rom(void) {
+	char path[] = "/tmp/gb-opbench-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+	size_t size = 8 * ROM_BANK_SIZE;
+	uint8_t* data = calloc(1, size);
+	if (data == NULL) {
+		close(fd);
+		return NULL;
+	}
+	for (size_t i = 0; i < size; i++)
+		data[i] = i * 7;
+	data[CARTRIDGE_TYPE_ADDRESS] = 0x1B;
+	data[0x0148] = 0x02;
+	data[CARTRIDGE_RAM_SIZE_ADDRESS] = 0x03;
+	bool written = write(fd, data, size) == (ssize_t)size;
+	free(data);
+	close(fd);
+	Rom* rom = written ? rom_open(path) : NULL;
+	unlink(path);
+	return rom;
+}
+
+static void set_registers(Cpu* cpu, const Registers* registers) {
+	cpu->a = registers->a;
+	cpu->f = registers->f;
+	cpu->b = registers->b;
+	cpu->c = registers->c;
+	cpu->d = registers->d;
+	cpu->e = registers->e;
+	cpu->h = registers->h;
+	cpu->l = registers->l;
+	cpu->sp = registers->sp;
+	cpu->pc = registers->pc;
+	cpu->halt = false;
+	cpu->interrupt_master_enable = false;
+}
+
+static void place_code(Cpu* cpu, uint8_t opcode, bool prefixed) {
+	int at = CODE_ADDRESS;
+	if (prefixed)
+		write_byte(cpu, at++, 0xCB);
+	write_byte(cpu, at++, opcode);
+	for (size_t i = 0; i < sizeof(operands); i++)
+		write_byte(cpu, at++, operands[i]);
+}
+
+//Nanoseconds per execution of the opcode at CODE_ADDRESS, including setting the registers
+static double time_execute(Cpu* cpu, const Registers* registers, uint8_t opcode, int iterations) {
+	for (int i = 0; i < WARM_UP; i++) {
+		set_registers(cpu, registers);
+		execute(cpu, opcode);
+	}
+	double best = 0;
+	for (int repeat = 0; repeat < REPEATS; repeat++) {
+		uint64_t start = pacer_now();
+		for (int i = 0; i < iterations; i++) {
+			set_registers(cpu, registers);
+			execute(cpu, opcode);
+		}
+		double ns = (double)(pacer_now() - start) / iterations;
+		if (repeat == 0 || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+//Same loop without the execute, taken off every handler's time
+static double time_restore(Cpu* cpu, int iterations) {
+	double best = 0;
+	for (int repeat = 0; repeat < REPEATS; repeat++) {
+		uint64_t start = pacer_now();
+		for (int i = 0; i < iterations; i++) {
+			set_registers(cpu, &start_registers);
+			__asm__ volatile("" ::: "memory");
+		}
+		double ns = (double)(pacer_now() - start) / iterations;
+		if (repeat == 0 || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+static double time_memory(Cpu* cpu, const MemoryRegion* region, int iterations) {
+	uint32_t sink = 0;
+	double best = 0;
+	//The first pass doesn't count, it warms up the caches
+	for (int repeat = -1; repeat < REPEATS; repeat++) {
+		uint64_t start = pacer_now();
+		for (int i = 0; i < iterations; i++) {
+			uint16_t address = region->address + i % region->span;
+			if (region->write)
+				write_byte(cpu, address, i & 0x07);
+			else
+				sink += read_byte(cpu, address);
+		}
+		double ns = (double)(pacer_now() - start) / iterations;
+		if (repeat == 0 || ns < best)
+			best = ns;
+	}
+	__asm__ volatile("" :: "r"(sink));
+	return best;
+}
+
+//Negative for unimplemented opcodes
+static void time_opcodes(Cpu* cpu, bool prefixed, double restore, int iterations, double* times) {
+	for (int opcode = 0; opcode < 256; opcode++) {
+		place_code(cpu, opcode, prefixed);
+		uint8_t executed = prefixed ? 0xCB : opcode;
+		hit_unimplemented = false;
+		set_registers(cpu, &start_registers);
+		if (prefixed)
+			cpu->pc++;
+		execute(cpu, executed);
+		if (hit_unimplemented) {
+			times[opcode] = -1;
+			continue;
+		}
+		//The prefix byte is already behind pc, as if it was fetched with the opcode
+		Registers registers = start_registers;
+		if (prefixed)
+			registers.pc++;
+		times[opcode] = time_execute(cpu, &registers, executed, iterations) - restore;
+	}
+}
+
+//Power in one frequency bin of APU_SAMPLE_RATE samples, so bin is in Hz. Goertzel's algorithm
+static double bin_power(const double* samples, int bin) {
+	double coefficient = 2 * cos(2 * M_PI * bin / APU_SAMPLE_RATE);
+	double s1 = 0, s2 = 0;
+	for (int i = 0; i < APU_SAMPLE_RATE; i++) {
+		double s = samples[i] + coefficient * s1 - s2;
+		s2 = s1;
+		s1 = s;
+	}
+	return s1 * s1 + s2 * s2 - coefficient * s1 * s2;
+}
+
+/*
+ * Plays a 50% square wave on channel 2 and takes a second of the left output
+ * once it has settled. Whatever isn't on a multiple of the tone's frequency
+ * is aliasing (or rounding). Aliases that happen to fold onto a harmonic
+ * aren't counted, none of the low order ones do for these tones.
+ * The harmonics fold about the sample rate, so every alias is on a multiple
+ * of gcd(frequency, APU_SAMPLE_RATE) and the audible ones can be picked out
+ * a bin at a time.
+ */
+static void measure_tone(int period, ToneResult* result) {
+	Apu* apu = malloc(sizeof(Apu));
+	if (apu == NULL) {
+		printf("Could not allocate apu\n");
+		exit(1);
+	}
+	reset_apu(apu);
+	uint16_t frequency = 2048 - period;
+	apu_write(apu, 0, NR50, 0x77);
+	apu_write(apu, 0, NR51, 0x22);							//Channel 2 on both sides
+	apu_write(apu, 0, NR21, 0x80);							//50% duty
+	apu_write(apu, 0, NR22, 0xF0);							//Full volume, no envelope
+	apu_write(apu, 0, NR23, frequency & 0xFF);
+	apu_write(apu, 0, NR24, 0x80 | (frequency >> 8));		//Trigger, no length
+
+	static double samples[APU_SAMPLE_RATE];
+	int16_t buffer[1024 * 2];
+	int skipped = 0, count = 0;
+	uint64_t now = 0, nanoseconds = 0;
+	while (count < APU_SAMPLE_RATE) {
+		now += FULL_FRAME_CLOCKS;
+		uint64_t start = pacer_now();
+		apu_sync(apu, now);
+		nanoseconds += pacer_now() - start;
+		int read;
+		while ((read = apu_read_samples(apu, buffer, 1024)) > 0) {
+			for (int i = 0; i < read; i++) {
+				if (skipped < AUDIO_WARM_UP)
+					skipped++;
+				else if (count < APU_SAMPLE_RATE)
+					samples[count++] = buffer[i * 2];
+			}
+		}
+	}
+	release_apu(apu);
+	free(apu);
+
+	//Parseval, the power in every bin but 0 is the power about the mean
+	double mean = 0;
+	for (int i = 0; i < APU_SAMPLE_RATE; i++)
+		mean += samples[i];
+	mean /= APU_SAMPLE_RATE;
+	double total = 0;
+	for (int i = 0; i < APU_SAMPLE_RATE; i++)
+		total += (samples[i] - mean) * (samples[i] - mean);
+	//Each harmonic below nyquist is a bin and its mirror image
+	result->frequency = APU_CLOCK_HZ / (period * 32);
+	double harmonics = 0;
+	for (int bin = result->frequency; bin < APU_SAMPLE_RATE / 2; bin += result->frequency)
+		harmonics += 2 * bin_power(samples, bin) / APU_SAMPLE_RATE;
+	result->all_aliasing = 10 * log10((total - harmonics) / harmonics);
+	int spacing = result->frequency;
+	for (int rate = APU_SAMPLE_RATE; rate != 0;) {
+		int remainder = spacing % rate;
+		spacing = rate;
+		rate = remainder;
+	}
+	double audible = 0;
+	for (int bin = spacing; bin < AUDIBLE_LIMIT; bin += spacing) {
+		if (bin % result->frequency != 0)
+			audible += 2 * bin_power(samples, bin) / APU_SAMPLE_RATE;
+	}
+	result->aliasing = 10 * log10(audible / harmonics);
+	result->ns_per_second = (double)nanoseconds / ((double)now / APU_CLOCK_HZ);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double median(const double* times) {
+	double sorted[256];
+	int count = 0;
+	for (int i = 0; i < 256; i++) {
+		if (times[i] >= 0)
+			sorted[count++] = times[i];
+	}
+	qsort(sorted, count, sizeof(double), compare_doubles);
+	return count > 0 ? sorted[count / 2] : 0;
+}
+
+static void print_grid(const char* title, const double* times) {
+	printf("%s, ns per execution (-- not implemented)\n    ", title);
+	for (int column = 0; column < 16; column++)
+		printf("   x%X", column);
+	printf("\n");
+	for (int row = 0; row < 16; row++) {
+		printf("  %Xx", row);
+		for (int column = 0; column < 16; column++) {
+			double ns = times[row * 16 + column];
+			if (ns < 0)
+				printf("   --");
+			else
+				printf(" %4.1f", ns);
+		}
+		printf("\n");
+	}
+}
+
+//Lists the slowest handlers against the median
+static void print_slowest(const char* prefix, const double* times) {
+	double typical = median(times);
+	int order[256];
+	for (int i = 0; i < 256; i++)
+		order[i] = i;
+	for (int i = 1; i < 256; i++) {
+		for (int j = i; j > 0 && times[order[j]] > times[order[j - 1]]; j--) {
+			int swap = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = swap;
+		}
+	}
+	printf("Median %.1f ns, slowest:", typical);
+	for (int i = 0; i < SLOWEST_SHOWN; i++)
+		printf(" %s%02X (%.1fx)", prefix, order[i], times[order[i]] / typical);
+	printf("\n\n");
+}
+
+static void print_json_opcodes(const char* name, const double* times, bool last) {
+	printf("  ");
+	print_json_string(name);
+	printf(": {");
+	bool first = true;
+	for (int i = 0; i < 256; i++) {
+		if (times[i] < 0)
+			continue;
+		printf("%s\n    \"%02X\": %.2f", first ? "" : ",", i, times[i]);
+		first = false;
+	}
+	printf("\n  }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char** argv) {
+	int iterations = DEFAULT_ITERATIONS;
+	bool json = false;
+	for (int arg = 1; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--iterations") == 0 && arg + 1 < argc) {
+			iterations = atoi(argv[++arg]);
+		} else if (strcmp(argv[arg], "--json") == 0) {
+			json = true;
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (iterations <= 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	Rom* rom = make_rom();
+	if (rom == NULL) {
+		printf("Could not create the test cartridge\n");
+		return 1;
+	}
+	Cpu* cpu = malloc(sizeof(Cpu));
+	if (cpu == NULL) {
+		printf("Could not allocate cpu\n");
+		return 1;
+	}
+	reset_cpu(cpu);
+	load_rom(cpu, rom);
+	rom_release(rom);
+	//Lcd off so no line is ever drawn, each handler is timed with only the bookkeeping every instruction pays
+	write_byte(cpu, 0xFF40, 0x00);
+	//Cartridge ram enabled, rom bank 1
+	write_byte(cpu, 0x0000, 0x0A);
+	write_byte(cpu, 0x2000, 0x01);
+	unimplemented_opcode_hook = note_unimplemented;
+
+	double restore = time_restore(cpu, iterations);
+	static double base[256], prefixed[256];
+	time_opcodes(cpu, false, restore, iterations, base);
+	time_opcodes(cpu, true, restore, iterations, prefixed);
+	double memory[NUM_MEMORY_REGIONS];
+	for (int i = 0; i < NUM_MEMORY_REGIONS; i++)
+		memory[i] = time_memory(cpu, &memory_regions[i], iterations);
+	ToneResult tones[AUDIO_TONES];
+	double worst_aliasing = -INFINITY;
+	for (int i = 0; i < AUDIO_TONES; i++) {
+		//The output is the same every time, only the timing varies
+		for (int repeat = 0; repeat < REPEATS; repeat++) {
+			ToneResult tone;
+			measure_tone(tone_periods[i], &tone);
+			if (repeat == 0 || tone.ns_per_second < tones[i].ns_per_second)
+				tones[i] = tone;
+		}
+		if (tones[i].aliasing > worst_aliasing)
+			worst_aliasing = tones[i].aliasing;
+	}
+
+	if (json) {
+		printf("{\n  \"iterations\": %d,\n", iterations);
+		print_json_opcodes("opcodes", base, false);
+		print_json_opcodes("cb_opcodes", prefixed, false);
+		printf("  \"memory\": [");
+		for (int i = 0; i < NUM_MEMORY_REGIONS; i++) {
+			const MemoryRegion* region = &memory_regions[i];
+			printf("%s\n    { \"name\": ", i == 0 ? "" : ",");
+			print_json_string(region->name);
+			printf(", \"access\": \"%s\", \"address\": %u, \"ns\": %.2f }", region->write ? "write" : "read", region->address, memory[i]);
+		}
+		printf("\n  ],\n");
+		printf("  \"audio\": {\n    \"worst_aliasing_db\": %.1f,\n    \"tones\": [", worst_aliasing);
+		for (int i = 0; i < AUDIO_TONES; i++) {
+			printf("%s\n      { \"hz\": %d, \"aliasing_db\": %.1f, \"all_aliasing_db\": %.1f, \"ns_per_second\": %.0f }", i == 0 ? "" : ",",
+				tones[i].frequency, tones[i].aliasing, tones[i].all_aliasing, tones[i].ns_per_second);
+		}
+		printf("\n    ]\n  }\n}\n");
+	} else {
+		print_grid("Opcodes", base);
+		print_slowest("", base);
+		print_grid("CB opcodes", prefixed);
+		print_slowest("CB ", prefixed);
+		printf("Memory, ns per access\n");
+		for (int i = 0; i < NUM_MEMORY_REGIONS; i++) {
+			const MemoryRegion* region = &memory_regions[i];
+			printf("  %-5s %-12s 0x%04X %6.1f\n", region->write ? "write" : "read", region->name, region->address, memory[i]);
+		}
+		printf("\nAudio, 50%% square wave on channel 2, a second of output per tone\n");
+		printf("     Hz  aliasing below %dkHz  all aliasing  ns per second of sound\n", AUDIBLE_LIMIT / 1000);
+		for (int i = 0; i < AUDIO_TONES; i++)
+			printf("  %5d  %16.1f dB  %9.1f dB  %8.0f\n", tones[i].frequency, tones[i].aliasing, tones[i].all_aliasing, tones[i].ns_per_second);
+		printf("Worst aliasing below %dkHz %.1f dB\n", AUDIBLE_LIMIT / 1000, worst_aliasing);
+	}
+
+	release_cpu(cpu);
+	free(cpu);
+	return 0;
+}
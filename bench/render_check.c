@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gpu.h"
+#include "memory.h"
+
+/*
+ * Drives the gpu through frames of random vram, scroll, window, lcdc and
+ * palette changes. Built against a gpu compiled with -DGPU_CHECK_RENDERER,
+ * so every line drawn is compared with the original pixel at a time
+ * renderer and every reused line with a fresh render, and the first
+ * mismatch exits non-zero. Changes land both between frames and part way
+ * through them, and the background plane is switched on and off, so line
+ * reuse and the plane's dirty tracking get checked as well as the drawing.
+ */
+
+#define DEFAULT_FRAMES      2000
+#define STEP_CLOCKS         4           //gpu_step is called once a machine cycle
+
+static uint64_t random_state;
+
+//xorshift64*, seeded from the command line so a failure can be repeated
+static uint32_t next_random(void) {
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return (random_state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+static void random_vram(Gpu* gpu, int bytes) {
+	//Mostly tile data, sometimes the maps
+	uint16_t start = next_random() % (GRAPHICS_RAM_END - GRAPHICS_RAM + 1);
+	for (int i = 0; i < bytes; i++)
+		write_vram(gpu, (start + i) % (GRAPHICS_RAM_END - GRAPHICS_RAM + 1), next_random());
+}
+
+//One change a game could make, picked at random
+static void random_change(Gpu* gpu) {
+	switch (next_random() % 9) {
+		case 0:
+			random_vram(gpu, 1 + next_random() % 64);
+			break;
+		case 1:
+			gpu->scroll_x = next_random();
+			break;
+		case 2:
+			gpu->scroll_y = next_random();
+			break;
+		case 3:
+			//The lcd stays on, turning it off is a different path in memory.c
+			gpu->lcdc = next_random() | 0x80;
+			break;
+		case 4:
+			set_background_palette(gpu, next_random());
+			break;
+		case 5:
+			set_object_palette(gpu, next_random() % 2, next_random());
+			break;
+		case 6:
+			gpu->window_x = next_random() % (SCREEN_WIDTH + 16);
+			gpu->window_y = next_random() % (SCREEN_HEIGHT + 16);
+			break;
+		case 7:
+			gpu->oam[next_random() % OAM_SIZE] = next_random();
+			break;
+		case 8:
+			if (next_random() % 8 == 0)
+				set_background_plane(gpu, !gpu->use_background_plane);
+			break;
+	}
+}
+
+int main(int argc, char** argv) {
+	int frames = DEFAULT_FRAMES;
+	uint64_t seed = 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			frames = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else {
+			printf("Usage: %s [--frames N] [--seed N]\n", argv[0]);
+			printf("Checks the renderer against the reference one over random frames, default %d\n", DEFAULT_FRAMES);
+			return 1;
+		}
+	}
+	random_state = seed ? seed : 1;
+
+	static Gpu gpu;
+	reset_gpu(&gpu);
+	gpu.lcdc = 0x91;
+	random_vram(&gpu, GRAPHICS_RAM_END - GRAPHICS_RAM + 1);
+	for (int i = 0; i < OAM_SIZE; i++)
+		gpu.oam[i] = next_random();
+
+	uint64_t reused = 0;
+	for (int frame = 0; frame < frames; frame++) {
+		//Half the frames change nothing, so lines get reused
+		int changes = next_random() % 2 ? 0 : next_random() % 16;
+		for (int i = 0; i < changes; i++)
+			random_change(&gpu);
+		//A few frames also change things while they're drawn
+		int mid_frame = next_random() % 4 == 0 ? 1 + next_random() % 8 : 0;
+		for (int clocks = 0; clocks < FULL_FRAME_CLOCKS; clocks += STEP_CLOCKS) {
+			if (mid_frame > 0 && next_random() % (FULL_FRAME_CLOCKS / STEP_CLOCKS / mid_frame) == 0)
+				random_change(&gpu);
+			gpu_step(&gpu, STEP_CLOCKS);
+		}
+		reused += gpu.last_frame_reused_lines;
+	}
+	printf("%d frames matched the reference renderer, %llu lines reused\n", frames, (unsigned long long)reused);
+	release_gpu(&gpu);
+	return 0;
+}
@@ -0,0 +1,363 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Writes small roms that each hammer one path of the emulator, so a
+ * change in gb-bench's numbers on one of them can be pinned on that path.
+ * Every rom runs one loop forever and only uses opcodes the cpu
+ * implements. The ones that only exercise the cpu switch the lcd off
+ * first, so no rendering gets mixed into their numbers.
+ */
+
+#define ROM_SIZE                0x8000
+#define CODE_START              0x0150
+#define FUNCTIONS               0x1000      //Targets for the call/ret rom
+#define TILE_SOURCE             0x4000      //Random bytes uploaded by the vram rom
+
+//Scratch variables in wram
+#define UPLOAD_COUNT            0xC000
+#define MAP_POINTER             0xC001
+
+static const uint8_t nintendo_logo[48] = {
+	0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83,
+	0x00, 0x0C, 0x00, 0x0D, 0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
+	0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99, 0xBB, 0xBB, 0x67, 0x63,
+	0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
+};
+
+typedef struct Assembler {
+	uint8_t rom[ROM_SIZE];
+	uint16_t at;
+} Assembler;
+
+static void emit(Assembler* assembler, int count, ...) {
+	va_list bytes;
+	va_start(bytes, count);
+	for (int i = 0; i < count; i++)
+		assembler->rom[assembler->at++] = va_arg(bytes, int);
+	va_end(bytes);
+}
+
+static void emit_word(Assembler* assembler, uint8_t opcode, uint16_t word) {
+	emit(assembler, 3, opcode, word & 0xFF, word >> 8);
+}
+
+//JR and its conditional forms, back to target
+static void jump_relative(Assembler* assembler, uint8_t opcode, uint16_t target) {
+	int offset = target - (assembler->at + 2);
+	if (offset < -128 || offset > 127) {
+		printf("Relative jump from 0x%04X to 0x%04X is out of range\n", assembler->at, target);
+		exit(1);
+	}
+	emit(assembler, 2, opcode, offset & 0xFF);
+}
+
+//Loops until LY is (JR NZ) or stops being (JR Z) 144, the first line of vblank
+static void wait_for_vblank(Assembler* assembler, uint8_t jump) {
+	uint16_t wait = assembler->at;
+	emit(assembler, 4,
+		0xF0, 0x44,				//LDH A,(LY)
+		0xFE, 0x90);			//CP 144
+	jump_relative(assembler, jump, wait);
+}
+
+static void start(Assembler* assembler, const char* title, bool lcd_off) {
+	memset(assembler->rom, 0, ROM_SIZE);
+	uint8_t* rom = assembler->rom;
+	//Entry point jumps over the header
+	assembler->at = 0x0100;
+	emit(assembler, 1, 0x00);
+	emit_word(assembler, 0xC3, CODE_START);
+	memcpy(rom + 0x0104, nintendo_logo, sizeof(nintendo_logo));
+	strncpy((char*)rom + 0x0134, title, 15);
+	rom[0x0147] = 0x00;				//No controller
+	rom[0x0148] = 0x00;				//32KB
+	rom[0x0149] = 0x00;				//No ram
+
+	assembler->at = CODE_START;
+	emit(assembler, 1, 0xF3);		//DI
+	emit_word(assembler, 0x31, 0xDFFE);		//LD SP,0xDFFE
+	if (lcd_off) {
+		wait_for_vblank(assembler, 0x20);
+		emit(assembler, 3,
+			0xAF,					//XOR A
+			0xE0, 0x40);			//LDH (LCDC),A
+	}
+}
+
+static void finish(Assembler* assembler) {
+	uint8_t* rom = assembler->rom;
+	uint8_t header = 0;
+	for (int i = 0x0134; i <= 0x014C; i++)
+		header = header - rom[i] - 1;
+	rom[0x014D] = header;
+	uint16_t global = 0;
+	for (int i = 0; i < ROM_SIZE; i++) {
+		if (i != 0x014E && i != 0x014F)
+			global += rom[i];
+	}
+	rom[0x014E] = global >> 8;
+	rom[0x014F] = global & 0xFF;
+}
+
+//Register to register arithmetic and logic, no memory access beyond the fetches
+static void build_alu(Assembler* assembler) {
+	start(assembler, "STRESS ALU", true);
+	emit(assembler, 12, 0x06, 0x13, 0x0E, 0x37, 0x16, 0x59, 0x1E, 0x7B, 0x26, 0x9D, 0x2E, 0xBF);	//LD B..L,n
+	uint16_t loop = assembler->at;
+	emit(assembler, 16,
+		0x80,					//ADD A,B
+		0x89,					//ADC A,C
+		0x92,					//SUB D
+		0x9B,					//SBC A,E
+		0xA4,					//AND H
+		0xAD,					//XOR L
+		0xB0,					//OR B
+		0xB9,					//CP C
+		0x04,					//INC B
+		0x0D,					//DEC C
+		0x14,					//INC D
+		0x1D,					//DEC E
+		0x2F,					//CPL
+		0x3C,					//INC A
+		0x09,					//ADD HL,BC
+		0x03);					//INC BC
+	emit(assembler, 9,
+		0x1B,					//DEC DE
+		0xC6, 0x07,				//ADD A,7
+		0xEE, 0x5A,				//XOR 0x5A
+		0xFE, 0x33,				//CP 0x33
+		0x07,					//RLCA
+		0x1F);					//RRA
+	jump_relative(assembler, 0x18, loop);
+}
+
+//Reads and read-modify-writes through HL, walking 0xC000 - 0xCFFF
+static void build_hl_memory(Assembler* assembler) {
+	start(assembler, "STRESS HL MEM", true);
+	emit_word(assembler, 0x21, 0xC000);		//LD HL,0xC000
+	uint16_t loop = assembler->at;
+	emit(assembler, 16,
+		0x2A,					//LD A,(HL+)
+		0x86,					//ADD A,(HL)
+		0x22,					//LD (HL+),A
+		0x34,					//INC (HL)
+		0xAE,					//XOR (HL)
+		0x77,					//LD (HL),A
+		0x23,					//INC HL
+		0x35,					//DEC (HL)
+		0xBE,					//CP (HL)
+		0x46,					//LD B,(HL)
+		0x70,					//LD (HL),B
+		0x3A,					//LD A,(HL-)
+		0x36, 0x5A,				//LD (HL),0x5A
+		0x23,					//INC HL
+		0x23);					//INC HL
+	//Keep HL in 0xC000 - 0xCFFF
+	emit(assembler, 6,
+		0x7C,					//LD A,H
+		0xE6, 0x0F,				//AND 0x0F
+		0xC6, 0xC0,				//ADD A,0xC0
+		0x67);					//LD H,A
+	jump_relative(assembler, 0x18, loop);
+}
+
+//CB prefixed bit operations, on registers and on (HL)
+static void build_cb_bits(Assembler* assembler) {
+	static const uint8_t operations[] = {
+		0x47,					//BIT 0,A
+		0x50,					//BIT 2,B
+		0x7E,					//BIT 7,(HL)
+		0xC1,					//SET 0,C
+		0x8A,					//RES 1,D
+		0x33,					//SWAP E
+		0x11,					//RL C
+		0x18,					//RR B
+		0x27,					//SLA A
+		0x3A,					//SRL D
+		0x2B,					//SRA E
+		0x00,					//RLC B
+		0x09,					//RRC C
+		0xC6,					//SET 0,(HL)
+		0x86,					//RES 0,(HL)
+		0x36,					//SWAP (HL)
+		0x16					//RL (HL)
+	};
+	start(assembler, "STRESS CB BITS", true);
+	emit_word(assembler, 0x21, 0xC000);		//LD HL,0xC000
+	uint16_t loop = assembler->at;
+	for (size_t i = 0; i < sizeof(operations); i++)
+		emit(assembler, 2, 0xCB, operations[i]);
+	jump_relative(assembler, 0x18, loop);
+}
+
+//Calls, returns, pushes and pops, everything through the stack
+static void build_call_ret(Assembler* assembler) {
+	start(assembler, "STRESS CALL RET", true);
+	uint16_t loop = assembler->at;
+	emit_word(assembler, 0xCD, FUNCTIONS);			//CALL outer
+	emit_word(assembler, 0xCD, FUNCTIONS + 0x10);	//CALL inner
+	emit(assembler, 8,
+		0xC5, 0xD5, 0xE5, 0xF5,	//PUSH BC, DE, HL, AF
+		0xF1, 0xE1, 0xD1, 0xC1);	//POP AF, HL, DE, BC
+	emit(assembler, 2,
+		0xAF,					//XOR A, sets Z
+		0x3C);					//INC A, clears it
+	emit_word(assembler, 0xC4, FUNCTIONS + 0x10);	//CALL NZ,inner, taken
+	emit(assembler, 1, 0xEF);	//RST 0x28
+	jump_relative(assembler, 0x18, loop);
+
+	//RST 0x28 returns straight away
+	assembler->rom[0x0028] = 0xC9;
+
+	//outer calls inner, which returns early on NZ half the time
+	assembler->at = FUNCTIONS;
+	emit_word(assembler, 0xCD, FUNCTIONS + 0x10);
+	emit(assembler, 1, 0xC9);	//RET
+	assembler->at = FUNCTIONS + 0x10;
+	emit(assembler, 4,
+		0x3C,					//INC A
+		0xE6, 0x01,				//AND 1
+		0xC0);					//RET NZ
+	emit(assembler, 1, 0xC9);	//RET
+}
+
+//Reads of the registers games poll, with the lcd running
+static void build_io_polling(Assembler* assembler) {
+	start(assembler, "STRESS IO POLL", false);
+	uint16_t loop = assembler->at;
+	emit(assembler, 6,
+		0xF0, 0x44,				//LDH A,(LY)
+		0xF0, 0x41,				//LDH A,(STAT)
+		0xF0, 0x04);			//LDH A,(DIV)
+	//Joypad the way games read it, select a row then read a few times to let it settle
+	emit(assembler, 8,
+		0x3E, 0x20,				//LD A,0x20
+		0xE0, 0x00,				//LDH (P1),A
+		0xF0, 0x00,				//LDH A,(P1)
+		0xF0, 0x00);			//LDH A,(P1)
+	emit(assembler, 8,
+		0x3E, 0x10,				//LD A,0x10
+		0xE0, 0x00,				//LDH (P1),A
+		0xF0, 0x00,				//LDH A,(P1)
+		0xF0, 0x00);			//LDH A,(P1)
+	emit(assembler, 4,
+		0xF0, 0x0F,				//LDH A,(IF)
+		0xF0, 0xFF);			//LDH A,(IE)
+	jump_relative(assembler, 0x18, loop);
+}
+
+//Every vblank copies 32 new tiles into vram and rewrites a tilemap row, scrolling as it goes,
+//so tile decoding and line redraws happen every frame
+static void build_vram_upload(Assembler* assembler) {
+	start(assembler, "STRESS VRAM", false);
+	emit(assembler, 2, 0x3E, 0x00);			//LD A,0
+	emit_word(assembler, 0xEA, MAP_POINTER);	//LD (MAP_POINTER),A
+	emit(assembler, 2, 0x3E, 0x98);			//LD A,0x98
+	emit_word(assembler, 0xEA, MAP_POINTER + 1);
+
+	uint16_t frame = assembler->at;
+	wait_for_vblank(assembler, 0x28);		//Out of the last vblank
+	wait_for_vblank(assembler, 0x20);		//Into the next
+
+	//Source is one of 16 256 byte blocks of bank 1, picked by the upload count
+	emit_word(assembler, 0xFA, UPLOAD_COUNT);	//LD A,(UPLOAD_COUNT)
+	emit(assembler, 1, 0x3C);				//INC A
+	emit_word(assembler, 0xEA, UPLOAD_COUNT);	//LD (UPLOAD_COUNT),A
+	emit(assembler, 7,
+		0xE6, 0x0F,				//AND 0x0F
+		0xC6, TILE_SOURCE >> 8,	//ADD A,0x40
+		0x57,					//LD D,A
+		0x1E, 0x00);			//LD E,0
+	//Into tiles 0-31, 0x200 bytes
+	emit_word(assembler, 0x21, 0x8000);		//LD HL,0x8000
+	emit_word(assembler, 0x01, 0x0200);		//LD BC,0x200
+	uint16_t copy = assembler->at;
+	emit(assembler, 6,
+		0x1A,					//LD A,(DE)
+		0x22,					//LD (HL+),A
+		0x13,					//INC DE
+		0x0B,					//DEC BC
+		0x78,					//LD A,B
+		0xB1);					//OR C
+	jump_relative(assembler, 0x20, copy);
+
+	//Next tilemap row, wrapping in 0x9800 - 0x9BFF
+	emit_word(assembler, 0xFA, MAP_POINTER);	//LD A,(MAP_POINTER)
+	emit(assembler, 1, 0x6F);				//LD L,A
+	emit_word(assembler, 0xFA, MAP_POINTER + 1);
+	emit(assembler, 3,
+		0x67,					//LD H,A
+		0x06, 0x20);			//LD B,32
+	uint16_t map = assembler->at;
+	emit(assembler, 4,
+		0x7D,					//LD A,L
+		0xE6, 0x1F,				//AND 0x1F, one of the new tiles
+		0x22);					//LD (HL+),A
+	emit(assembler, 1, 0x05);				//DEC B
+	jump_relative(assembler, 0x20, map);
+	emit(assembler, 6,
+		0x7C,					//LD A,H
+		0xE6, 0x03,				//AND 3
+		0xC6, 0x98,				//ADD A,0x98
+		0x67);					//LD H,A
+	emit(assembler, 1, 0x7D);				//LD A,L
+	emit_word(assembler, 0xEA, MAP_POINTER);
+	emit(assembler, 1, 0x7C);				//LD A,H
+	emit_word(assembler, 0xEA, MAP_POINTER + 1);
+
+	emit(assembler, 5,
+		0xF0, 0x43,				//LDH A,(SCX)
+		0x3C,					//INC A
+		0xE0, 0x43);			//LDH (SCX),A
+	jump_relative(assembler, 0x18, frame);
+
+	//Tile data to upload, anything but blank
+	uint32_t seed = 0x2545F491;
+	for (int i = TILE_SOURCE; i < ROM_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		assembler->rom[i] = seed >> 24;
+	}
+}
+
+typedef struct StressRom {
+	const char* name;
+	void (*build)(Assembler* assembler);
+} StressRom;
+
+static const StressRom stress_roms[] = {
+	{ "alu", build_alu },
+	{ "hl_memory", build_hl_memory },
+	{ "cb_bits", build_cb_bits },
+	{ "call_ret", build_call_ret },
+	{ "io_polling", build_io_polling },
+	{ "vram_upload", build_vram_upload },
+};
+
+int main(int argc, char** argv) {
+	if (argc > 2) {
+		printf("Usage: %s [directory]\n", argv[0]);
+		printf("Writes stress_<name>.gb for each stress rom into directory, default .\n");
+		return 1;
+	}
+	const char* directory = argc == 2 ? argv[1] : ".";
+	static Assembler assembler;
+	for (size_t i = 0; i < sizeof(stress_roms) / sizeof(stress_roms[0]); i++) {
+		stress_roms[i].build(&assembler);
+		finish(&assembler);
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/stress_%s.gb", directory, stress_roms[i].name);
+		FILE* file = fopen(path, "wb");
+		if (file == NULL || fwrite(assembler.rom, 1, ROM_SIZE, file) != ROM_SIZE) {
+			printf("Could not write %s\n", path);
+			return 1;
+		}
+		fclose(file);
+		printf("%s\n", path);
+	}
+	return 0;
+}
@@ -0,0 +1,610 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apu.h"
+
+//Bits that always read back as 1, 0xFF10 - 0xFF2F. Wave ram reads back as written
+static const uint8_t read_masks[WAVE_RAM - NR10] = {
+	0x80, 0x3F, 0x00, 0xFF, 0xBF,		//NR10 - NR14
+	0xFF, 0x3F, 0x00, 0xFF, 0xBF,		//NR20 - NR24
+	0x7F, 0xFF, 0x9F, 0xFF, 0xBF,		//NR30 - NR34
+	0xFF, 0xFF, 0x00, 0x00, 0xBF,		//NR40 - NR44
+	0x00, 0x00, 0x70,					//NR50 - NR52
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+//Square wave shapes, one bit per step: 12.5%, 25%, 50% and 75%
+static const uint8_t duty_patterns[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+static const uint8_t noise_divisors[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+
+//The same for every instance, filled in once by build_filters
+static float blep[BLEP_PHASES][BLEP_WIDTH];		//Band limited step, spread over BLEP_WIDTH samples
+static float decimation[DECIMATION_TAPS];			//Low pass filter applied when dropping to the output rate
+static pthread_once_t filters_once = PTHREAD_ONCE_INIT;
+static void build_filters(void);
+
+void reset_apu(Apu* apu) {
+	memset(apu, 0, sizeof(Apu));
+	apu->power = true;
+	apu->registers[NR52 - NR10] = 0x80;
+	apu->sequencer_timer = APU_SEQUENCER_CLOCKS;
+	apu->noise.period = noise_divisors[0];
+	pthread_once(&filters_once, build_filters);
+}
+
+void share_apu(Apu* apu) {
+	apu->output = NULL;
+	apu->output_start = (apu->time * APU_INTERNAL_STEP) >> APU_INTERNAL_SHIFT;
+	apu->profile = NULL;
+	if (apu->queue != NULL)
+		page_share(apu->queue);
+}
+
+void release_apu(Apu* apu) {
+	free(apu->output);
+	apu->output = NULL;
+	page_release(apu->queue);
+	apu->queue = NULL;
+}
+
+static void trigger_envelope(Envelope* envelope) {
+	envelope->volume = envelope->reg >> 4;
+	envelope->timer = envelope->reg & 0x07;
+}
+
+static void clock_envelope(Envelope* envelope) {
+	uint8_t period = envelope->reg & 0x07;
+	if (period == 0)
+		return;
+	if (envelope->timer > 1) {
+		envelope->timer--;
+		return;
+	}
+	envelope->timer = period;
+	if ((envelope->reg & 0x08) && envelope->volume < 15)
+		envelope->volume++;
+	else if (!(envelope->reg & 0x08) && envelope->volume > 0)
+		envelope->volume--;
+}
+
+//Frequency the sweep would set next, above 2047 turns the channel off
+static uint16_t sweep_target(const SquareChannel* square) {
+	uint16_t delta = square->sweep_shadow >> square->sweep_shift;
+	return square->sweep_negate ? square->sweep_shadow - delta : square->sweep_shadow + delta;
+}
+
+static void clock_sweep(SquareChannel* square) {
+	if (square->sweep_timer > 1) {
+		square->sweep_timer--;
+		return;
+	}
+	square->sweep_timer = square->sweep_period ? square->sweep_period : 8;
+	if (!square->sweep_enabled || square->sweep_period == 0)
+		return;
+	uint16_t target = sweep_target(square);
+	if (target > 2047) {
+		square->enabled = false;
+	} else if (square->sweep_shift) {
+		square->frequency = square->sweep_shadow = target;
+		//The new frequency is checked again straight away
+		if (sweep_target(square) > 2047)
+			square->enabled = false;
+	}
+}
+
+static void clock_length(uint16_t* length, bool length_enabled, bool* enabled) {
+	if (length_enabled && *length > 0 && --*length == 0)
+		*enabled = false;
+}
+
+//Length every other step, sweep on steps 2 and 6, envelopes on step 7
+static void clock_sequencer(Apu* apu) {
+	uint8_t step = apu->sequencer_step;
+	if ((step & 1) == 0) {
+		for (int i = 0; i < 2; i++)
+			clock_length(&apu->squares[i].length, apu->squares[i].length_enabled, &apu->squares[i].enabled);
+		clock_length(&apu->wave.length, apu->wave.length_enabled, &apu->wave.enabled);
+		clock_length(&apu->noise.length, apu->noise.length_enabled, &apu->noise.enabled);
+	}
+	if (step == 2 || step == 6)
+		clock_sweep(&apu->squares[0]);
+	if (step == 7) {
+		clock_envelope(&apu->squares[0].envelope);
+		clock_envelope(&apu->squares[1].envelope);
+		clock_envelope(&apu->noise.envelope);
+	}
+	apu->sequencer_step = (step + 1) & 7;
+}
+
+static void trigger_square(SquareChannel* square, bool has_sweep) {
+	square->enabled = square->dac;
+	if (square->length == 0)
+		square->length = 64;
+	square->timer = (2048 - square->frequency) * 4;
+	trigger_envelope(&square->envelope);
+	if (has_sweep) {
+		square->sweep_shadow = square->frequency;
+		square->sweep_timer = square->sweep_period ? square->sweep_period : 8;
+		square->sweep_enabled = square->sweep_period || square->sweep_shift;
+		if (square->sweep_shift && sweep_target(square) > 2047)
+			square->enabled = false;
+	}
+}
+
+static void trigger_wave(WaveChannel* wave) {
+	wave->enabled = wave->dac;
+	if (wave->length == 0)
+		wave->length = 256;
+	wave->timer = (2048 - wave->frequency) * 2;
+	wave->position = 0;
+}
+
+static void trigger_noise(NoiseChannel* noise) {
+	noise->enabled = noise->dac;
+	if (noise->length == 0)
+		noise->length = 64;
+	noise->timer = noise->period;
+	noise->lfsr = 0x7FFF;
+	trigger_envelope(&noise->envelope);
+}
+
+//Everything but wave ram is cleared while the power is off
+static void power_off(Apu* apu) {
+	uint8_t wave_ram[sizeof(apu->wave.ram)];
+	memcpy(wave_ram, apu->wave.ram, sizeof(wave_ram));
+	memset(apu->squares, 0, sizeof(apu->squares));
+	memset(&apu->wave, 0, sizeof(apu->wave));
+	memset(&apu->noise, 0, sizeof(apu->noise));
+	memcpy(apu->wave.ram, wave_ram, sizeof(wave_ram));
+	apu->noise.period = noise_divisors[0];
+	apu->master_volume = 0;
+	apu->panning = 0;
+}
+
+//Applies a queued write to the channels
+static void apply_write(Apu* apu, uint16_t address, uint8_t value) {
+	if (address >= WAVE_RAM) {
+		apu->wave.ram[address - WAVE_RAM] = value;
+		return;
+	}
+	if (address == NR52) {
+		bool power = value & 0x80;
+		if (apu->power && !power)
+			power_off(apu);
+		if (!apu->power && power)
+			apu->sequencer_step = 0;
+		apu->power = power;
+		return;
+	}
+	if (!apu->power)
+		return;
+
+	//NR1x and NR2x line up, so both squares share the same handling
+	SquareChannel* square = &apu->squares[address < NR21 - 1 ? 0 : 1];
+	switch (address) {
+		case NR10:
+			square->sweep_period = (value >> 4) & 0x07;
+			square->sweep_negate = value & 0x08;
+			square->sweep_shift = value & 0x07;
+			break;
+		case NR11:
+		case NR21:
+			square->duty = value >> 6;
+			square->length = 64 - (value & 0x3F);
+			break;
+		case NR12:
+		case NR22:
+			square->envelope.reg = value;
+			//The top 5 bits all being 0 turns the dac off
+			square->dac = (value & 0xF8) != 0;
+			if (!square->dac)
+				square->enabled = false;
+			break;
+		case NR13:
+		case NR23:
+			square->frequency = (square->frequency & 0x700) | value;
+			break;
+		case NR14:
+		case NR24:
+			square->frequency = (square->frequency & 0xFF) | ((value & 0x07) << 8);
+			square->length_enabled = value & 0x40;
+			if (value & 0x80)
+				trigger_square(square, address == NR14);
+			break;
+		case NR30:
+			apu->wave.dac = value & 0x80;
+			if (!apu->wave.dac)
+				apu->wave.enabled = false;
+			break;
+		case NR31:
+			apu->wave.length = 256 - value;
+			break;
+		case NR32:
+			apu->wave.volume_code = (value >> 5) & 0x03;
+			break;
+		case NR33:
+			apu->wave.frequency = (apu->wave.frequency & 0x700) | value;
+			break;
+		case NR34:
+			apu->wave.frequency = (apu->wave.frequency & 0xFF) | ((value & 0x07) << 8);
+			apu->wave.length_enabled = value & 0x40;
+			if (value & 0x80)
+				trigger_wave(&apu->wave);
+			break;
+		case NR41:
+			apu->noise.length = 64 - (value & 0x3F);
+			break;
+		case NR42:
+			apu->noise.envelope.reg = value;
+			apu->noise.dac = (value & 0xF8) != 0;
+			if (!apu->noise.dac)
+				apu->noise.enabled = false;
+			break;
+		case NR43:
+			apu->noise.period = noise_divisors[value & 0x07] << (value >> 4);
+			apu->noise.narrow = value & 0x08;
+			break;
+		case NR44:
+			apu->noise.length_enabled = value & 0x40;
+			if (value & 0x80)
+				trigger_noise(&apu->noise);
+			break;
+		case NR50:
+			apu->master_volume = value;
+			break;
+		case NR51:
+			apu->panning = value;
+			break;
+	}
+}
+
+//Blackman window over 0 - 1
+static double blackman(double x) {
+	return 0.42 - 0.5 * cos(2 * M_PI * x) + 0.08 * cos(4 * M_PI * x);
+}
+
+//Low pass filter kernel, cutoff in cycles per sample, x in samples from the centre
+static double windowed_sinc(double x, double cutoff, double width) {
+	double sinc = x == 0 ? 1 : sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+	return 2 * cutoff * sinc * blackman(x / width + 0.5);
+}
+
+static void build_filters(void) {
+	//The step is the running sum of a low pass kernel, sampled BLEP_PHASES times per sample.
+	//Cutting off at 0.45 keeps anything that could alias back below 20kHz well down
+	double step[BLEP_WIDTH * BLEP_PHASES + 1];
+	double sum = 0;
+	step[0] = 0;
+	for (int i = 1; i <= BLEP_WIDTH * BLEP_PHASES; i++) {
+		double x = (double)i / BLEP_PHASES - BLEP_WIDTH / 2.0;
+		sum += windowed_sinc(x, 0.45, BLEP_WIDTH) / BLEP_PHASES;
+		step[i] = sum;
+	}
+	//Each phase is stored as the differences between samples of the step,
+	//scaled so an edge always adds up to exactly its height
+	for (int phase = 0; phase < BLEP_PHASES; phase++) {
+		double total = 0;
+		for (int tap = 0; tap < BLEP_WIDTH; tap++) {
+			int end = (tap + 1) * BLEP_PHASES - phase;
+			int start = end - BLEP_PHASES < 0 ? 0 : end - BLEP_PHASES;
+			blep[phase][tap] = step[end] - step[start];
+			total += blep[phase][tap];
+		}
+		for (int tap = 0; tap < BLEP_WIDTH; tap++)
+			blep[phase][tap] /= total;
+	}
+
+	//20kHz at the internal rate
+	double total = 0;
+	for (int tap = 0; tap < DECIMATION_TAPS; tap++) {
+		double x = tap - (DECIMATION_TAPS - 1) / 2.0;
+		decimation[tap] = windowed_sinc(x, 20000.0 / APU_INTERNAL_RATE, DECIMATION_TAPS);
+		total += decimation[tap];
+	}
+	for (int tap = 0; tap < DECIMATION_TAPS; tap++)
+		decimation[tap] /= total;
+}
+
+static ApuOutput* get_output(Apu* apu) {
+	if (apu->output == NULL) {
+		apu->output = calloc(1, sizeof(ApuOutput));
+		if (apu->output == NULL) {
+			printf("Could not allocate sound output\n");
+			exit(1);
+		}
+		//Everything since output_start was silence, which a new buffer already holds.
+		//Pick up where flush_output would have got to had it been running all along
+		ApuOutput* output = apu->output;
+		uint64_t now = (apu->time * APU_INTERNAL_STEP) >> APU_INTERNAL_SHIFT;
+		uint64_t silent = now - apu->output_start;
+		uint64_t made = silent < DECIMATION_TAPS ? 0 : (silent - DECIMATION_TAPS) / APU_OVERSAMPLE + 1;
+		output->delta_start = now;
+		output->waveform_length = silent - made * APU_OVERSAMPLE;
+		output->write_index = (uint32_t)made;
+		if (made > APU_BUFFER_FRAMES)
+			output->read_index = output->write_index - APU_BUFFER_FRAMES;
+		apu->samples_made += made;
+	}
+	return apu->output;
+}
+
+//Adds a step in the output at clock time, spread over the internal samples around it
+static void add_edge(Apu* apu, uint64_t time, int left, int right) {
+	ApuOutput* output = get_output(apu);
+	uint64_t position = time * APU_INTERNAL_STEP;
+	uint32_t index = (position >> APU_INTERNAL_SHIFT) - output->delta_start;
+	const float* step = blep[(position >> (APU_INTERNAL_SHIFT - BLEP_PHASE_BITS)) & (BLEP_PHASES - 1)];
+	for (int tap = 0; tap < BLEP_WIDTH; tap++) {
+		output->deltas[0][index + tap] += left * step[tap];
+		output->deltas[1][index + tap] += right * step[tap];
+	}
+	apu->edges++;
+}
+
+//Each channel gives 0 - 15, which the dacs turn into -15 - 15
+static int channel_level(const Apu* apu, int channel) {
+	if (channel < 2) {
+		const SquareChannel* square = &apu->squares[channel];
+		if (!square->enabled)
+			return 0;
+		int high = (duty_patterns[square->duty] >> (7 - square->duty_step)) & 0x01;
+		return (high ? square->envelope.volume : 0) * 2 - 15;
+	}
+	if (channel == 2) {
+		if (!apu->wave.enabled)
+			return 0;
+		uint8_t sample = apu->wave.ram[apu->wave.position / 2];
+		sample = (apu->wave.position & 1) ? sample & 0x0F : sample >> 4;
+		//Volume codes 0 - 3 are mute, 100%, 50% and 25%
+		sample = apu->wave.volume_code ? sample >> (apu->wave.volume_code - 1) : 0;
+		return sample * 2 - 15;
+	}
+	if (!apu->noise.enabled)
+		return 0;
+	return ((apu->noise.lfsr & 0x01) ? 0 : apu->noise.envelope.volume) * 2 - 15;
+}
+
+//Adds an edge if the channel's share of the output has changed
+static void update_channel(Apu* apu, int channel, uint64_t time) {
+	int level = channel_level(apu, channel);
+	int left = (apu->panning & (0x10 << channel)) ? level * (((apu->master_volume >> 4) & 0x07) + 1) : 0;
+	int right = (apu->panning & (0x01 << channel)) ? level * ((apu->master_volume & 0x07) + 1) : 0;
+	int* current = apu->channel_outputs[channel];
+	if (left != current[0] || right != current[1]) {
+		add_edge(apu, time, left - current[0], right - current[1]);
+		current[0] = left;
+		current[1] = right;
+	}
+}
+
+static void update_channels(Apu* apu, uint64_t time) {
+	for (int channel = 0; channel < 4; channel++)
+		update_channel(apu, channel, time);
+}
+
+/*
+ * Runs a channel from apu->time to end, an edge at a time.
+ * timer is the clocks until it next steps, every step after that is period apart
+ */
+#define RUN_CHANNEL(apu, channel, timer, period, end, step) \
+	do { \
+		uint64_t time = (apu)->time; \
+		while ((end) - time >= (timer)) { \
+			time += (timer); \
+			(timer) = (period); \
+			step; \
+			update_channel((apu), (channel), time); \
+		} \
+		(timer) -= (end) - time; \
+	} while (0)
+
+static void run_channels(Apu* apu, uint64_t end) {
+	for (int i = 0; i < 2; i++) {
+		SquareChannel* square = &apu->squares[i];
+		if (square->enabled)
+			RUN_CHANNEL(apu, i, square->timer, (2048u - square->frequency) * 4, end,
+				square->duty_step = (square->duty_step + 1) & 0x07);
+	}
+	WaveChannel* wave = &apu->wave;
+	if (wave->enabled)
+		RUN_CHANNEL(apu, 2, wave->timer, (2048u - wave->frequency) * 2, end,
+			wave->position = (wave->position + 1) & 0x1F);
+	NoiseChannel* noise = &apu->noise;
+	if (noise->enabled) {
+		RUN_CHANNEL(apu, 3, noise->timer, noise->period, end, {
+			uint16_t bit = (noise->lfsr ^ (noise->lfsr >> 1)) & 0x01;
+			noise->lfsr = (noise->lfsr >> 1) | (bit << 14);
+			if (noise->narrow)
+				noise->lfsr = (noise->lfsr & ~0x40) | (bit << 6);
+		});
+	}
+}
+
+/*
+ * Decimation filter, one output sample from DECIMATION_TAPS internal samples.
+ * Build with -DAPU_NO_SIMD to force the scalar version.
+ */
+#if defined(__SSE2__) && !defined(APU_NO_SIMD)
+#include <immintrin.h>
+
+static float decimate_sse(const float* waveform, const float* taps) {
+	__m128 sum = _mm_setzero_ps();
+	for (int tap = 0; tap < DECIMATION_TAPS; tap += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(waveform + tap), _mm_loadu_ps(taps + tap)));
+	//Add the 4 lanes together
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x55));
+	return _mm_cvtss_f32(sum);
+}
+#define decimate decimate_sse
+#else
+static float decimate_scalar(const float* waveform, const float* taps) {
+	float sum = 0;
+	for (int tap = 0; tap < DECIMATION_TAPS; tap++)
+		sum += waveform[tap] * taps[tap];
+	return sum;
+}
+#define decimate decimate_scalar
+#endif
+
+static int16_t clamp_sample(float sample) {
+	//At most 4 channels * 15 * 8, scaled to use most of 16 bits
+	sample *= 64;
+	if (sample > INT16_MAX)
+		return INT16_MAX;
+	if (sample < INT16_MIN)
+		return INT16_MIN;
+	return (int16_t)sample;
+}
+
+//Turns every internal sample before now into levels, then into output samples
+static void flush_output(Apu* apu, uint64_t now) {
+	//No edges yet so the level is still 0, get_output makes up the silence if it's ever asked for
+	ApuOutput* output = apu->output;
+	if (output == NULL)
+		return;
+	uint32_t count = ((now * APU_INTERNAL_STEP) >> APU_INTERNAL_SHIFT) - output->delta_start;
+	if (count == 0)
+		return;
+
+	for (int side = 0; side < 2; side++) {
+		float* deltas = output->deltas[side];
+		float* waveform = &output->waveform[side][output->waveform_length];
+		//Integrating the deltas gives the level, leaking a little to take out any dc
+		float level = output->level[side];
+		for (uint32_t i = 0; i < count; i++) {
+			level = level * APU_HIGH_PASS + deltas[i];
+			waveform[i] = level;
+		}
+		//Left to decay in silence it would reach denormals, which are many times slower to work with
+		if (fabsf(level) < APU_SILENCE)
+			level = 0;
+		output->level[side] = level;
+		//Keep the tails of the latest edges
+		memmove(deltas, &deltas[count], BLEP_WIDTH * sizeof(float));
+		memset(&deltas[BLEP_WIDTH], 0, count * sizeof(float));
+	}
+	output->delta_start += count;
+	output->waveform_length += count;
+
+	//Every APU_OVERSAMPLE internal samples makes an output sample
+	int made = 0;
+	for (; made * APU_OVERSAMPLE + DECIMATION_TAPS <= output->waveform_length; made++) {
+		uint32_t index = output->write_index & (APU_BUFFER_FRAMES - 1);
+		output->samples[index * 2] = clamp_sample(decimate(&output->waveform[0][made * APU_OVERSAMPLE], decimation));
+		output->samples[index * 2 + 1] = clamp_sample(decimate(&output->waveform[1][made * APU_OVERSAMPLE], decimation));
+		output->write_index++;
+	}
+	int used = made * APU_OVERSAMPLE;
+	output->waveform_length -= used;
+	for (int side = 0; side < 2; side++)
+		memmove(output->waveform[side], &output->waveform[side][used], output->waveform_length * sizeof(float));
+	apu->samples_made += made;
+
+	//Nobody is reading fast enough, drop the oldest
+	if (output->write_index - output->read_index > APU_BUFFER_FRAMES)
+		output->read_index = output->write_index - APU_BUFFER_FRAMES;
+}
+
+//Runs the channels up to until, a frame sequencer step at a time
+static void run_until(Apu* apu, uint64_t until) {
+	while (apu->time < until) {
+		uint64_t end = until;
+		if (end - apu->time > apu->sequencer_timer)
+			end = apu->time + apu->sequencer_timer;
+
+		run_channels(apu, end);
+		apu->sequencer_timer -= end - apu->time;
+		apu->time = end;
+
+		if (apu->sequencer_timer == 0) {
+			apu->sequencer_timer = APU_SEQUENCER_CLOCKS;
+			if (apu->power) {
+				clock_sequencer(apu);
+				update_channels(apu, end);
+			}
+		}
+		//Never more than a sequencer step's worth, which is what deltas has room for
+		flush_output(apu, end);
+	}
+}
+
+void apu_sync(Apu* apu, uint64_t now) {
+	uint64_t start = profile_begin(apu->profile);
+	for (int i = 0; i < apu->queued; i++) {
+		const ApuWrite* write = &((const ApuWrite*)apu->queue->data)[i];
+		run_until(apu, write->time);
+		apply_write(apu, write->address, write->value);
+		update_channels(apu, apu->time);
+	}
+	apu->queued = 0;
+	run_until(apu, now);
+	profile_end(apu->profile, PROFILE_APU, start);
+}
+
+uint8_t apu_read(Apu* apu, uint64_t now, uint16_t address) {
+	if (address >= WAVE_RAM)
+		return apu->registers[address - NR10];
+	if (address == NR52) {
+		//Channels switch themselves off, so they have to be up to date
+		apu_sync(apu, now);
+		uint8_t status = apu->registers[NR52 - NR10] | read_masks[NR52 - NR10];
+		status |= apu->squares[0].enabled ? 0x01 : 0;
+		status |= apu->squares[1].enabled ? 0x02 : 0;
+		status |= apu->wave.enabled ? 0x04 : 0;
+		status |= apu->noise.enabled ? 0x08 : 0;
+		return status;
+	}
+	return apu->registers[address - NR10] | read_masks[address - NR10];
+}
+
+void apu_write(Apu* apu, uint64_t now, uint16_t address, uint8_t value) {
+	uint8_t* registers = apu->registers;
+	if (address == NR52) {
+		//Turning the power off clears every register but wave ram
+		if (!(value & 0x80))
+			memset(registers, 0, NR52 - NR10);
+		registers[NR52 - NR10] = value & 0x80;
+	} else if (address >= WAVE_RAM) {
+		registers[address - NR10] = value;
+	} else if (registers[NR52 - NR10] & 0x80) {
+		registers[address - NR10] = value;
+	} else {
+		//Powered off, the write is lost
+		return;
+	}
+
+	//Nothing queued and the channels are already at now (the power on values reset_cpu
+	//writes), so the write can go straight in. Queueing it would end up the same
+	if (apu->queued == 0 && now == apu->time) {
+		apply_write(apu, address, value);
+		update_channels(apu, now);
+		return;
+	}
+	if (apu->queued == APU_QUEUE_SIZE)
+		apu_sync(apu, now);
+	if (apu->queue == NULL)
+		apu->queue = page_alloc(APU_QUEUE_SIZE * sizeof(ApuWrite));
+	ApuWrite* write = &((ApuWrite*)page_make_writable(&apu->queue))[apu->queued++];
+	write->time = now;
+	write->address = address;
+	write->value = value;
+}
+
+int apu_read_samples(Apu* apu, int16_t* out, int frames) {
+	ApuOutput* output = get_output(apu);
+	uint32_t available = output->write_index - output->read_index;
+	if ((uint32_t)frames > available)
+		frames = available;
+	for (int i = 0; i < frames; i++) {
+		uint32_t index = (output->read_index + i) & (APU_BUFFER_FRAMES - 1);
+		out[i * 2] = output->samples[index * 2];
+		out[i * 2 + 1] = output->samples[index * 2 + 1];
+	}
+	output->read_index += frames;
+	return frames;
+}
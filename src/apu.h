@@ -0,0 +1,191 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "page.h"
+#include "profile.h"
+
+#define APU_CLOCK_HZ            4194304
+#define APU_SAMPLE_RATE         48000
+#define APU_BUFFER_FRAMES       8192        //Stereo samples kept for the reader, must be a power of 2
+#define APU_QUEUE_SIZE          256         //Register writes held before the channels are brought up to date
+#define APU_SEQUENCER_CLOCKS    8192        //Frame sequencer runs at 512Hz
+#define APU_NUM_REGISTERS       0x30        //0xFF10 - 0xFF3F
+
+//Channel edges are drawn as band limited steps at 4 times the output rate,
+//which is then low pass filtered and decimated to APU_SAMPLE_RATE
+#define APU_OVERSAMPLE          4
+#define APU_INTERNAL_RATE       (APU_SAMPLE_RATE * APU_OVERSAMPLE)
+#define APU_INTERNAL_SHIFT      13          //Internal samples per clock is 375 / (1 << 13), exactly 192000 / 4194304
+#define APU_INTERNAL_STEP       375
+#define BLEP_PHASE_BITS         5
+#define BLEP_PHASES             (1 << BLEP_PHASE_BITS)  //Positions between internal samples an edge can land on
+#define BLEP_WIDTH              8           //Internal samples each edge is spread over
+#define DECIMATION_TAPS         32
+#define APU_DELTA_SIZE          512         //Internal samples in a frame sequencer step (375), plus room
+#define APU_HIGH_PASS           0.9995f     //Leak of the integrator per internal sample, stands in for the output capacitor
+#define APU_SILENCE             1e-12f      //Integrator level treated as 0
+
+enum ApuRegisters {
+	NR10 = 0xFF10,			//Channel 1 sweep
+	NR11 = 0xFF11,			//Channel 1 duty and length
+	NR12 = 0xFF12,			//Channel 1 envelope
+	NR13 = 0xFF13,			//Channel 1 frequency low
+	NR14 = 0xFF14,			//Channel 1 trigger, length enable, frequency high
+	NR21 = 0xFF16,			//Channel 2, as channel 1 without the sweep
+	NR22 = 0xFF17,
+	NR23 = 0xFF18,
+	NR24 = 0xFF19,
+	NR30 = 0xFF1A,			//Channel 3 (wave) dac power
+	NR31 = 0xFF1B,			//Channel 3 length
+	NR32 = 0xFF1C,			//Channel 3 volume
+	NR33 = 0xFF1D,
+	NR34 = 0xFF1E,
+	NR41 = 0xFF20,			//Channel 4 (noise) length
+	NR42 = 0xFF21,			//Channel 4 envelope
+	NR43 = 0xFF22,			//Channel 4 lfsr clock and width
+	NR44 = 0xFF23,			//Channel 4 trigger and length enable
+	NR50 = 0xFF24,			//Master volume
+	NR51 = 0xFF25,			//Panning
+	NR52 = 0xFF26,			//Power and channel status
+	WAVE_RAM = 0xFF30		//0xFF30 - 0xFF3F, 32 4 bit samples
+};
+
+typedef struct Envelope {
+	uint8_t reg;			//NRx2, bits 4-7 starting volume, bit 3 up, bits 0-2 period
+	uint8_t volume;
+	uint8_t timer;
+} Envelope;
+
+typedef struct SquareChannel {
+	bool enabled;
+	bool dac;
+	uint8_t duty;
+	uint8_t duty_step;
+	uint16_t frequency;
+	uint32_t timer;			//Clocks until the next duty step
+	uint16_t length;
+	bool length_enabled;
+	Envelope envelope;
+
+	//Channel 1 only
+	uint8_t sweep_period;
+	uint8_t sweep_shift;
+	bool sweep_negate;
+	bool sweep_enabled;
+	uint8_t sweep_timer;
+	uint16_t sweep_shadow;
+} SquareChannel;
+
+typedef struct WaveChannel {
+	bool enabled;
+	bool dac;
+	uint16_t frequency;
+	uint32_t timer;
+	uint8_t position;		//0 - 31, high nibble of each byte first
+	uint16_t length;
+	bool length_enabled;
+	uint8_t volume_code;
+	uint8_t ram[16];
+} WaveChannel;
+
+typedef struct NoiseChannel {
+	bool enabled;
+	bool dac;
+	uint32_t period;
+	uint32_t timer;
+	uint16_t lfsr;
+	bool narrow;			//7 bit lfsr
+	uint16_t length;
+	bool length_enabled;
+	Envelope envelope;
+} NoiseChannel;
+
+/*
+ * Everything needed to turn channel edges into output samples. Only
+ * allocated at the first edge or the first apu_read_samples, so a silent
+ * instance nobody reads from (like most forks, which start with their own)
+ * doesn't carry it. The filters are shared by every instance, see apu.c.
+ */
+typedef struct ApuOutput {
+	//Changes in level at the internal rate, left and right. deltas[][0] is internal sample delta_start
+	float deltas[2][APU_DELTA_SIZE + BLEP_WIDTH];
+	uint64_t delta_start;
+	float level[2];
+
+	//Levels waiting to be decimated
+	float waveform[2][DECIMATION_TAPS + APU_DELTA_SIZE];
+	int waveform_length;
+
+	//Interleaved left/right output samples
+	int16_t samples[APU_BUFFER_FRAMES * 2];
+	uint32_t write_index;
+	uint32_t read_index;
+} ApuOutput;
+
+typedef struct ApuWrite {
+	uint64_t time;
+	uint16_t address;
+	uint8_t value;
+} ApuWrite;
+
+/*
+ * Sound, 2 square channels, a wave channel and a noise channel.
+ * Nothing runs per instruction. Register writes are stamped with the cpu
+ * clock and queued, and the channels are only run, a batch of samples
+ * at a time, when apu_sync is called at the end of a frame, when the queue
+ * fills up or when NR52 is read. Queued writes are applied at the clock
+ * they were made at, so the output is the same as if the channels had
+ * been run alongside the cpu.
+ *
+ * Channels are run from one edge (a change in their output) to the next
+ * rather than clock by clock, and each edge is added to the output as a
+ * band limited step, see ApuOutput.
+ * Build with -DAPU_NO_SIMD to force the scalar decimation filter.
+ */
+typedef struct Apu {
+	//What the cpu reads back, updated as soon as it writes
+	uint8_t registers[APU_NUM_REGISTERS];
+
+	//Channel state, as of time
+	uint64_t time;
+	bool power;
+	SquareChannel squares[2];
+	WaveChannel wave;
+	NoiseChannel noise;
+	uint8_t master_volume;
+	uint8_t panning;
+	uint32_t sequencer_timer;
+	uint8_t sequencer_step;
+	int channel_outputs[4][2];	//What each channel currently adds to the left and right output
+
+	//APU_QUEUE_SIZE ApuWrites, a page so forks share it until they write.
+	//NULL until the first write that has to wait, so instances that never touch sound after power on don't carry it
+	MemoryPage* queue;
+	int queued;
+
+	ApuOutput* output;
+	uint64_t output_start;		//Internal sample the output begins at, everything before output was made is silence
+
+	//For benchmarks, output cost follows the number of edges rather than the clock rate
+	uint64_t edges;
+	uint64_t samples_made;
+	Profile* profile;
+} Apu;
+
+void reset_apu(Apu* apu);
+
+//Called on an apu that was just copied from another, the copy gets its own sample buffer
+void share_apu(Apu* apu);
+void release_apu(Apu* apu);
+
+//now is the cpu's clock count, Cpu.total_t
+uint8_t apu_read(Apu* apu, uint64_t now, uint16_t address);
+void apu_write(Apu* apu, uint64_t now, uint16_t address, uint8_t value);
+
+//Runs the channels up to now, applying queued writes on the way
+void apu_sync(Apu* apu, uint64_t now);
+
+//Copies up to frames stereo samples into out, returns how many were copied.
+//If they aren't read fast enough the oldest samples are dropped
+int apu_read_samples(Apu* apu, int16_t* out, int frames);
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio_capture.h"
+
+#define WAV_HEADER_SIZE 44
+
+static void put_le(uint8_t* at, uint32_t value, int bytes) {
+	for (int i = 0; i < bytes; i++)
+		at[i] = value >> (i * 8);
+}
+
+//Sizes are filled in by audio_capture_close, once they are known
+static bool write_wav_header(FILE* file, int sample_rate, uint64_t frames) {
+	uint64_t data_size = frames * 4;
+	//Sizes are 32 bit, a capture over about 6 hours still plays up to there
+	if (data_size > UINT32_MAX - WAV_HEADER_SIZE)
+		data_size = UINT32_MAX - WAV_HEADER_SIZE;
+	uint8_t header[WAV_HEADER_SIZE];
+	memcpy(header, "RIFF", 4);
+	put_le(header + 4, data_size + WAV_HEADER_SIZE - 8, 4);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_le(header + 16, 16, 4);						//fmt chunk size
+	put_le(header + 20, 1, 2);						//PCM
+	put_le(header + 22, 2, 2);						//Channels
+	put_le(header + 24, sample_rate, 4);
+	put_le(header + 28, sample_rate * 4, 4);		//Bytes per second
+	put_le(header + 32, 4, 2);						//Bytes per frame
+	put_le(header + 34, 16, 2);						//Bits per sample
+	memcpy(header + 36, "data", 4);
+	put_le(header + 40, data_size, 4);
+	return fwrite(header, 1, WAV_HEADER_SIZE, file) == WAV_HEADER_SIZE;
+}
+
+static CaptureBlock* take_free_block(AudioCapture* capture) {
+	pthread_mutex_lock(&capture->lock);
+	CaptureBlock* block = capture->free_blocks;
+	if (block != NULL)
+		capture->free_blocks = block->next;
+	pthread_mutex_unlock(&capture->lock);
+
+	if (block == NULL) {
+		block = malloc(sizeof(CaptureBlock));
+		if (block == NULL) {
+			printf("Could not allocate audio capture buffer\n");
+			exit(1);
+		}
+	}
+	block->next = NULL;
+	block->frames = 0;
+	return block;
+}
+
+static void queue_block(AudioCapture* capture, CaptureBlock* block) {
+	pthread_mutex_lock(&capture->lock);
+	if (capture->full_tail != NULL)
+		capture->full_tail->next = block;
+	else
+		capture->full_head = block;
+	capture->full_tail = block;
+	pthread_cond_signal(&capture->ready);
+	pthread_mutex_unlock(&capture->lock);
+}
+
+static void write_block(AudioCapture* capture, CaptureBlock* block) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (int i = 0; i < block->frames * 2; i++)
+		block->samples[i] = __builtin_bswap16(block->samples[i]);
+#endif
+	if (fwrite(block->samples, 4, block->frames, capture->file) != (size_t)block->frames)
+		capture->failed = true;
+	capture->frames_written += block->frames;
+}
+
+static void* writer(void* data) {
+	AudioCapture* capture = data;
+	pthread_mutex_lock(&capture->lock);
+	while (true) {
+		while (capture->full_head == NULL && !capture->closing)
+			pthread_cond_wait(&capture->ready, &capture->lock);
+		CaptureBlock* block = capture->full_head;
+		if (block == NULL)
+			break;
+		capture->full_head = block->next;
+		if (capture->full_head == NULL)
+			capture->full_tail = NULL;
+		pthread_mutex_unlock(&capture->lock);
+
+		write_block(capture, block);
+
+		pthread_mutex_lock(&capture->lock);
+		block->next = capture->free_blocks;
+		capture->free_blocks = block;
+	}
+	pthread_mutex_unlock(&capture->lock);
+	return NULL;
+}
+
+AudioCapture* audio_capture_open(const char* path, int sample_rate) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL)
+		return NULL;
+	AudioCapture* capture = calloc(1, sizeof(AudioCapture));
+	if (capture == NULL) {
+		printf("Could not allocate audio capture\n");
+		exit(1);
+	}
+	capture->file = file;
+	size_t length = strlen(path);
+	capture->wav = length >= 4 && strcmp(path + length - 4, ".wav") == 0;
+	capture->sample_rate = sample_rate;
+	if (capture->wav && !write_wav_header(file, sample_rate, 0))
+		capture->failed = true;
+
+	pthread_mutex_init(&capture->lock, NULL);
+	pthread_cond_init(&capture->ready, NULL);
+	for (int i = 0; i < CAPTURE_INITIAL_BLOCKS; i++) {
+		CaptureBlock* block = take_free_block(capture);
+		block->next = capture->free_blocks;
+		capture->free_blocks = block;
+	}
+	capture->current = take_free_block(capture);
+	if (pthread_create(&capture->thread, NULL, writer, capture) != 0) {
+		printf("Could not start audio capture thread\n");
+		exit(1);
+	}
+	return capture;
+}
+
+void audio_capture_write(AudioCapture* capture, const int16_t* samples, int frames) {
+	while (frames > 0) {
+		CaptureBlock* block = capture->current;
+		int count = CAPTURE_BLOCK_FRAMES - block->frames;
+		if (count > frames)
+			count = frames;
+		memcpy(block->samples + block->frames * 2, samples, count * 4);
+		block->frames += count;
+		samples += count * 2;
+		frames -= count;
+		if (block->frames == CAPTURE_BLOCK_FRAMES) {
+			queue_block(capture, block);
+			capture->current = take_free_block(capture);
+		}
+	}
+}
+
+bool audio_capture_close(AudioCapture* capture) {
+	if (capture->current->frames > 0)
+		queue_block(capture, capture->current);
+	else
+		free(capture->current);
+
+	pthread_mutex_lock(&capture->lock);
+	capture->closing = true;
+	pthread_cond_signal(&capture->ready);
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->thread, NULL);
+
+	if (capture->wav) {
+		if (fseek(capture->file, 0, SEEK_SET) != 0 || !write_wav_header(capture->file, capture->sample_rate, capture->frames_written))
+			capture->failed = true;
+	}
+	if (fclose(capture->file) != 0)
+		capture->failed = true;
+
+	while (capture->free_blocks != NULL) {
+		CaptureBlock* block = capture->free_blocks;
+		capture->free_blocks = block->next;
+		free(block);
+	}
+	pthread_mutex_destroy(&capture->lock);
+	pthread_cond_destroy(&capture->ready);
+	bool ok = !capture->failed;
+	free(capture);
+	return ok;
+}
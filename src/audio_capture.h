@@ -0,0 +1,51 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_BLOCK_FRAMES    65536       //Stereo frames per block handed to the writer, about 1.4s
+#define CAPTURE_INITIAL_BLOCKS  4
+
+typedef struct CaptureBlock {
+	struct CaptureBlock* next;
+	int frames;
+	int16_t samples[CAPTURE_BLOCK_FRAMES * 2];
+} CaptureBlock;
+
+/*
+ * Streams output samples to a file, 16 bit stereo, as a WAV file if the
+ * path ends in .wav and as raw little endian PCM otherwise.
+ * The emulation thread only ever copies into a large block. Full blocks
+ * are handed to a writer thread, and the lock is held just long enough
+ * to move a pointer between lists, never across any file I/O. If the disk
+ * falls behind (or emulation runs unthrottled faster than it can write)
+ * more blocks are allocated rather than making the emulation wait.
+ */
+typedef struct AudioCapture {
+	FILE* file;
+	bool wav;
+	int sample_rate;
+	uint64_t frames_written;			//Writer thread only until it has been joined
+	bool failed;
+
+	CaptureBlock* current;				//Being filled by the emulation thread
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	CaptureBlock* free_blocks;			//Guarded by lock
+	CaptureBlock* full_head;			//Guarded by lock, oldest first
+	CaptureBlock* full_tail;
+	bool closing;						//Guarded by lock
+} AudioCapture;
+
+//Returns NULL if the file can't be created
+AudioCapture* audio_capture_open(const char* path, int sample_rate);
+
+//Emulation thread. Queues frames stereo frames to be written
+void audio_capture_write(AudioCapture* capture, const int16_t* samples, int frames);
+
+//Writes everything still queued, finishes the WAV header and frees the capture.
+//Returns false if anything failed to write
+bool audio_capture_close(AudioCapture* capture);
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "audio_ring.h"
+
+void audio_ring_init(AudioRing* ring, uint32_t size, uint32_t target_fill, int input_rate, int output_rate) {
+	ring->samples = calloc(size * 2, sizeof(int16_t));
+	if (ring->samples == NULL) {
+		printf("Could not allocate audio buffer of %u frames\n", size);
+		exit(1);
+	}
+	ring->size = size;
+	ring->target_fill = target_fill;
+	atomic_init(&ring->write_index, 0);
+	atomic_init(&ring->read_index, 0);
+	ring->base_ratio = (double)input_rate / output_rate;
+	ring->ratio = ring->base_ratio;
+	ring->drift = 0;
+	ring->position = 0;
+	ring->previous[0] = ring->previous[1] = 0;
+	ring->last[0] = ring->last[1] = 0;
+}
+
+void audio_ring_free(AudioRing* ring) {
+	free(ring->samples);
+	ring->samples = NULL;
+}
+
+uint32_t audio_ring_fill(AudioRing* ring) {
+	return atomic_load_explicit(&ring->write_index, memory_order_acquire) - atomic_load_explicit(&ring->read_index, memory_order_acquire);
+}
+
+void audio_ring_write(AudioRing* ring, const int16_t* samples, int frames) {
+	uint32_t write = atomic_load_explicit(&ring->write_index, memory_order_relaxed);
+	//Acquire so the consumer is done with the frames it has given back
+	uint32_t read = atomic_load_explicit(&ring->read_index, memory_order_acquire);
+	uint32_t mask = ring->size - 1;
+
+	//Above target, take more input per output frame to bring it down, below, less
+	double error = ((double)(write - read) - ring->target_fill) / ring->target_fill;
+	if (error > 1)
+		error = 1;
+	else if (error < -1)
+		error = -1;
+	ring->drift += error * AUDIO_RING_DRIFT_GAIN;
+	if (ring->drift > AUDIO_RING_MAX_ADJUST)
+		ring->drift = AUDIO_RING_MAX_ADJUST;
+	else if (ring->drift < -AUDIO_RING_MAX_ADJUST)
+		ring->drift = -AUDIO_RING_MAX_ADJUST;
+	ring->ratio = ring->base_ratio * (1 + error * AUDIO_RING_MAX_ADJUST + ring->drift);
+
+	//Linear interpolation, each output frame lies position of the way from previous to the next input
+	for (int i = 0; i < frames; i++) {
+		const int16_t* next = samples + i * 2;
+		while (ring->position < 1) {
+			if (write - read == ring->size)
+				goto full;
+			int16_t* out = ring->samples + (write & mask) * 2;
+			out[0] = ring->previous[0] + (int)((next[0] - ring->previous[0]) * ring->position);
+			out[1] = ring->previous[1] + (int)((next[1] - ring->previous[1]) * ring->position);
+			write++;
+			ring->position += ring->ratio;
+		}
+	full:
+		ring->position -= 1;
+		if (ring->position < 0)
+			ring->position = 0;
+		ring->previous[0] = next[0];
+		ring->previous[1] = next[1];
+	}
+	//Release so the samples are written before the consumer can see them
+	atomic_store_explicit(&ring->write_index, write, memory_order_release);
+}
+
+void audio_ring_read(AudioRing* ring, int16_t* out, int frames) {
+	uint32_t read = atomic_load_explicit(&ring->read_index, memory_order_relaxed);
+	uint32_t write = atomic_load_explicit(&ring->write_index, memory_order_acquire);
+	uint32_t mask = ring->size - 1;
+	for (int i = 0; i < frames; i++) {
+		if (read != write) {
+			ring->last[0] = ring->samples[(read & mask) * 2];
+			ring->last[1] = ring->samples[(read & mask) * 2 + 1];
+			read++;
+		}
+		out[i * 2] = ring->last[0];
+		out[i * 2 + 1] = ring->last[1];
+	}
+	atomic_store_explicit(&ring->read_index, read, memory_order_release);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+
+//How far the resampling ratio is allowed to move from nominal to keep the
+//ring at its target fill, half a percent is well under what can be heard
+#define AUDIO_RING_MAX_ADJUST   0.005
+
+//How quickly a steady difference between the two clocks is learned, per write
+#define AUDIO_RING_DRIFT_GAIN   0.00001
+
+/*
+ * Carries stereo samples from the emulation thread to the audio callback.
+ * One producer, one consumer, no locks: each side only ever stores its own
+ * index, so the callback can never be held up by the emulation thread.
+ *
+ * Emulation is paced by the system clock and the sound card by its own,
+ * so the two never quite agree. Rather than letting the ring slowly run
+ * dry or overflow (crackles either way), the producer resamples what it
+ * is given, nudging the ratio by up to AUDIO_RING_MAX_ADJUST in
+ * proportion to how far the fill level is from target_fill. The steady
+ * part of the difference is learned in drift, so the fill settles on the
+ * target itself rather than wherever the correction balances the clocks.
+ */
+typedef struct AudioRing {
+	int16_t* samples;					//Interleaved left/right
+	uint32_t size;						//In stereo frames, a power of 2
+	uint32_t target_fill;
+	atomic_uint write_index;			//Only stored by the producer, free running
+	atomic_uint read_index;				//Only stored by the consumer, free running
+
+	//Producer only
+	double base_ratio;					//Input frames per output frame, input rate / output rate
+	double ratio;						//base_ratio with the fill correction applied
+	double drift;						//Learned difference between the clocks, within AUDIO_RING_MAX_ADJUST
+	double position;					//Between previous and the next input frame, 0 - 1
+	int16_t previous[2];
+
+	//Consumer only, repeated when the ring runs dry so an underrun doesn't click
+	int16_t last[2];
+} AudioRing;
+
+//size must be a power of 2, exits if out of memory
+void audio_ring_init(AudioRing* ring, uint32_t size, uint32_t target_fill, int input_rate, int output_rate);
+void audio_ring_free(AudioRing* ring);
+
+//Stereo frames waiting to be read
+uint32_t audio_ring_fill(AudioRing* ring);
+
+//Producer side. Resamples frames stereo frames from samples into the ring,
+//whatever doesn't fit is dropped
+void audio_ring_write(AudioRing* ring, const int16_t* samples, int frames);
+
+//Consumer side. Always fills all frames of out, holding the last sample if
+//the ring runs dry
+void audio_ring_read(AudioRing* ring, int16_t* out, int frames);
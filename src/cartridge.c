@@ -0,0 +1,346 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cartridge.h"
+#include "cpu.h"
+#include "memory.h"
+
+static pthread_mutex_t open_roms_lock = PTHREAD_MUTEX_INITIALIZER;
+static Rom* open_roms = NULL;
+
+//Maps the file read only, padding it with zeros up to a whole number of banks
+//so every page in the memory map is backed even for tiny or odd sized roms
+static uint8_t* map_rom_file(int fd, size_t size, size_t mapped_size) {
+	uint8_t* mapping = mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		return NULL;
+	if (size > 0 && mmap(mapping, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(mapping, mapped_size);
+		return NULL;
+	}
+	return mapping;
+}
+
+Rom* rom_open(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	struct stat info;
+	if (fstat(fd, &info) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&open_roms_lock);
+	for (Rom* rom = open_roms; rom != NULL; rom = rom->next) {
+		if (rom->device == info.st_dev && rom->inode == info.st_ino) {
+			rom_share(rom);
+			pthread_mutex_unlock(&open_roms_lock);
+			close(fd);
+			return rom;
+		}
+	}
+
+	size_t size = info.st_size;
+	size_t mapped_size = (size + ROM_BANK_SIZE - 1) / ROM_BANK_SIZE * ROM_BANK_SIZE;
+	//Bank 0 and the switchable bank always need something behind them
+	if (mapped_size < 2 * ROM_BANK_SIZE)
+		mapped_size = 2 * ROM_BANK_SIZE;
+
+	Rom* rom = NULL;
+	uint8_t* data = map_rom_file(fd, size, mapped_size);
+	close(fd);
+	if (data != NULL)
+		rom = malloc(sizeof(Rom));
+	if (rom == NULL) {
+		if (data != NULL)
+			munmap(data, mapped_size);
+		pthread_mutex_unlock(&open_roms_lock);
+		return NULL;
+	}
+	atomic_init(&rom->ref_count, 1);
+	rom->data = data;
+	rom->size = size;
+	rom->mapped_size = mapped_size;
+	rom->device = info.st_dev;
+	rom->inode = info.st_ino;
+	rom->next = open_roms;
+	open_roms = rom;
+	pthread_mutex_unlock(&open_roms_lock);
+	return rom;
+}
+
+Rom* rom_share(Rom* rom) {
+	atomic_fetch_add_explicit(&rom->ref_count, 1, memory_order_relaxed);
+	return rom;
+}
+
+void rom_release(Rom* rom) {
+	if (rom == NULL)
+		return;
+	//Lock first so rom_open can't hand out a rom that is being unmapped
+	pthread_mutex_lock(&open_roms_lock);
+	if (atomic_fetch_sub_explicit(&rom->ref_count, 1, memory_order_acq_rel) != 1) {
+		pthread_mutex_unlock(&open_roms_lock);
+		return;
+	}
+	for (Rom** link = &open_roms; *link != NULL; link = &(*link)->next) {
+		if (*link == rom) {
+			*link = rom->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&open_roms_lock);
+	munmap(rom->data, rom->mapped_size);
+	free(rom);
+}
+
+//Copies the banks written since the last call into the save file's mapping
+static void flush_save_banks(Cartridge* cart) {
+	for (int i = 0; i < cart->ram_bank_count; i++) {
+		if (cart->save_dirty_banks & (1 << i))
+			memcpy(cart->save + i * RAM_BANK_SIZE, cart->ram_banks[i]->data, RAM_BANK_SIZE);
+	}
+	cart->save_dirty_banks = 0;
+}
+
+//Unmapping leaves the kernel to write back anything still dirty, so this never blocks on the disk
+static void detach_save_file(Cartridge* cart) {
+	if (cart->save == NULL)
+		return;
+	flush_save_banks(cart);
+	munmap(cart->save, cart->save_size);
+	cart->save = NULL;
+	cart->save_size = 0;
+}
+
+//Points the rom pages of the memory map at the banks selected by the controller
+static void update_rom_map(Cpu* cpu) {
+	Cartridge* cart = &cpu->cart;
+	uint16_t low_bank = 0;
+	uint16_t high_bank = cart->rom_bank;
+	if (cart->mapper == MBC1) {
+		high_bank = (cart->upper_bits << 5) | (cart->rom_bank & 0x1F);
+		//Mode 1 also applies the upper bits to the bank 0 slot
+		if (cart->banking_mode == 1)
+			low_bank = cart->upper_bits << 5;
+	}
+	//Roms are always a power of two banks, mirror anything past the end
+	low_bank %= cart->rom_bank_count;
+	high_bank %= cart->rom_bank_count;
+
+	const uint8_t* low = cpu->rom->data + low_bank * ROM_BANK_SIZE;
+	const uint8_t* high = cpu->rom->data + high_bank * ROM_BANK_SIZE;
+	cpu->rom_map[0] = low;
+	cpu->rom_map[1] = low + MEMORY_PAGE_SIZE;
+	cpu->rom_map[2] = high;
+	cpu->rom_map[3] = high + MEMORY_PAGE_SIZE;
+}
+
+static uint8_t current_ram_bank(Cartridge* cart) {
+	if (cart->mapper == MBC1)
+		return cart->banking_mode == 1 ? cart->upper_bits : 0;
+	return cart->ram_bank;
+}
+
+static void read_header(Cartridge* cart, const Rom* rom) {
+	uint8_t type = rom->data[CARTRIDGE_TYPE_ADDRESS];
+	switch (type) {
+		case 0x00: cart->mapper = NO_MAPPER; break;
+		case 0x01:
+		case 0x02: cart->mapper = MBC1; break;
+		case 0x03: cart->mapper = MBC1; cart->battery = true; break;
+		case 0x08: cart->mapper = NO_MAPPER; break;
+		case 0x09: cart->mapper = NO_MAPPER; cart->battery = true; break;
+		case 0x0F:
+		case 0x10: cart->mapper = MBC3; cart->battery = true; break;
+		case 0x11:
+		case 0x12: cart->mapper = MBC3; break;
+		case 0x13: cart->mapper = MBC3; cart->battery = true; break;
+		case 0x19:
+		case 0x1A: cart->mapper = MBC5; break;
+		case 0x1B: cart->mapper = MBC5; cart->battery = true; break;
+		case 0x1C:
+		case 0x1D: cart->mapper = MBC5; cart->rumble = true; break;
+		case 0x1E: cart->mapper = MBC5; cart->rumble = true; cart->battery = true; break;
+		default:
+			printf("Cartridge type %#X not supported, running without a bank controller\n", type);
+			cart->mapper = NO_MAPPER;
+			break;
+	}
+
+	switch (rom->data[CARTRIDGE_RAM_SIZE_ADDRESS]) {
+		case 0x01: cart->ram_bank_count = 1; break;		//2KB, still gets a whole bank
+		case 0x02: cart->ram_bank_count = 1; break;
+		case 0x03: cart->ram_bank_count = 4; break;
+		case 0x04: cart->ram_bank_count = 16; break;
+		case 0x05: cart->ram_bank_count = 8; break;
+		default: cart->ram_bank_count = 0; break;
+	}
+	cart->rom_bank_count = rom->mapped_size / ROM_BANK_SIZE;
+}
+
+void load_rom(Cpu* cpu, Rom* rom) {
+	rom_share(rom);
+	rom_release(cpu->rom);
+	cpu->rom = rom;
+
+	Cartridge* cart = &cpu->cart;
+	release_cartridge(cart);
+	memset(cart, 0, sizeof(Cartridge));
+	read_header(cart, rom);
+	for (int i = 0; i < cart->ram_bank_count; i++)
+		cart->ram_banks[i] = page_alloc(RAM_BANK_SIZE);
+	cart->rom_bank = 1;
+	update_rom_map(cpu);
+}
+
+static void mbc1_write(Cpu* cpu, uint16_t address, uint8_t value) {
+	Cartridge* cart = &cpu->cart;
+	switch (address >> 13) {
+		case 0: cart->ram_enabled = (value & 0x0F) == 0x0A; break;
+		case 1:
+			cart->rom_bank = value & 0x1F;
+			//Bank 0 can't be selected into the switchable slot
+			if (cart->rom_bank == 0)
+				cart->rom_bank = 1;
+			break;
+		case 2: cart->upper_bits = value & 0x03; break;
+		case 3: cart->banking_mode = value & 0x01; break;
+	}
+}
+
+static void mbc3_write(Cpu* cpu, uint16_t address, uint8_t value) {
+	Cartridge* cart = &cpu->cart;
+	switch (address >> 13) {
+		case 0: cart->ram_enabled = (value & 0x0F) == 0x0A; break;
+		case 1:
+			cart->rom_bank = value & 0x7F;
+			if (cart->rom_bank == 0)
+				cart->rom_bank = 1;
+			break;
+		case 2: cart->ram_bank = value; break;
+		case 3:
+			//Writing 0 then 1 latches the clock
+			if (cart->rtc_latch == 0x00 && value == 0x01)
+				memcpy(cart->latched_rtc, cart->rtc, sizeof(cart->rtc));
+			cart->rtc_latch = value;
+			break;
+	}
+}
+
+static void mbc5_write(Cpu* cpu, uint16_t address, uint8_t value) {
+	Cartridge* cart = &cpu->cart;
+	if (address < 0x2000) {
+		cart->ram_enabled = (value & 0x0F) == 0x0A;
+	} else if (address < 0x3000) {
+		cart->rom_bank = (cart->rom_bank & 0x100) | value;
+	} else if (address < 0x4000) {
+		cart->rom_bank = (cart->rom_bank & 0xFF) | ((value & 0x01) << 8);
+	} else if (address < 0x6000) {
+		//Bit 3 drives the rumble motor instead on rumble carts
+		cart->ram_bank = value & (cart->rumble ? 0x07 : 0x0F);
+	}
+}
+
+void cartridge_write(Cpu* cpu, uint16_t address, uint8_t value) {
+	switch (cpu->cart.mapper) {
+		case MBC1: mbc1_write(cpu, address, value); break;
+		case MBC3: mbc3_write(cpu, address, value); break;
+		case MBC5: mbc5_write(cpu, address, value); break;
+		//Nothing to switch, rom is read only
+		default: return;
+	}
+	update_rom_map(cpu);
+}
+
+uint8_t cartridge_read_ram(Cpu* cpu, uint16_t address) {
+	Cartridge* cart = &cpu->cart;
+	//Carts without a controller have their ram always enabled
+	if (!cart->ram_enabled && cart->mapper != NO_MAPPER)
+		return 0xFF;
+
+	uint8_t bank = current_ram_bank(cart);
+	if (cart->mapper == MBC3 && bank >= 0x08 && bank <= 0x0C)
+		return cart->latched_rtc[bank - 0x08];
+	if (bank >= cart->ram_bank_count)
+		return 0xFF;
+	return cart->ram_banks[bank]->data[address - EXTERNAL_CARTRIDGE_RAM];
+}
+
+void cartridge_write_ram(Cpu* cpu, uint16_t address, uint8_t value) {
+	Cartridge* cart = &cpu->cart;
+	if (!cart->ram_enabled && cart->mapper != NO_MAPPER)
+		return;
+
+	uint8_t bank = current_ram_bank(cart);
+	if (cart->mapper == MBC3 && bank >= 0x08 && bank <= 0x0C) {
+		cart->rtc[bank - 0x08] = value;
+		return;
+	}
+	if (bank >= cart->ram_bank_count)
+		return;
+	page_make_writable(&cart->ram_banks[bank])[address - EXTERNAL_CARTRIDGE_RAM] = value;
+	cart->save_dirty_banks |= 1 << bank;
+}
+
+bool attach_save_file(Cpu* cpu, const char* path) {
+	Cartridge* cart = &cpu->cart;
+	if (!cart->battery || cart->ram_bank_count == 0)
+		return true;
+
+	size_t size = cart->ram_bank_count * RAM_BANK_SIZE;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	//Grow new or short saves, anything past the ram (such as clock data) is left alone
+	if (fstat(fd, &info) < 0 || ((size_t)info.st_size < size && ftruncate(fd, size) < 0)) {
+		close(fd);
+		return false;
+	}
+	uint8_t* save = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (save == MAP_FAILED)
+		return false;
+
+	detach_save_file(cart);
+	for (int i = 0; i < cart->ram_bank_count; i++)
+		memcpy(page_make_writable(&cart->ram_banks[i]), save + i * RAM_BANK_SIZE, RAM_BANK_SIZE);
+	cart->save = save;
+	cart->save_size = size;
+	cart->save_dirty_banks = 0;
+	return true;
+}
+
+void cartridge_sync(Cpu* cpu) {
+	Cartridge* cart = &cpu->cart;
+	if (cart->save == NULL || cart->save_dirty_banks == 0)
+		return;
+	flush_save_banks(cart);
+	//MS_ASYNC only schedules the writeback
+	msync(cart->save, cart->save_size, MS_ASYNC);
+}
+
+void share_cartridge(Cartridge* cart) {
+	for (int i = 0; i < cart->ram_bank_count; i++)
+		page_share(cart->ram_banks[i]);
+	cart->save = NULL;
+	cart->save_size = 0;
+	cart->save_dirty_banks = 0;
+}
+
+void release_cartridge(Cartridge* cart) {
+	for (int i = 0; i < cart->ram_bank_count; i++) {
+		page_release(cart->ram_banks[i]);
+		cart->ram_banks[i] = NULL;
+	}
+	cart->ram_bank_count = 0;
+	detach_save_file(cart);
+}
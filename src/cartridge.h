@@ -0,0 +1,113 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "page.h"
+
+#define ROM_BANK_SIZE               0x4000
+#define RAM_BANK_SIZE               0x2000
+#define MAX_RAM_BANKS               16
+
+#define CARTRIDGE_TYPE_ADDRESS      0x0147
+#define CARTRIDGE_RAM_SIZE_ADDRESS  0x0149
+
+enum Mappers {
+	NO_MAPPER,
+	MBC1,
+	MBC3,
+	MBC5
+};
+
+//MBC3 real time clock registers, selected by writing 0x08 - 0x0C to 0x4000 - 0x5FFF
+enum RtcRegisters {
+	RTC_SECONDS,
+	RTC_MINUTES,
+	RTC_HOURS,
+	RTC_DAY_LOW,
+	RTC_DAY_HIGH,
+	NUM_RTC_REGISTERS
+};
+
+/*
+ * Read only cartridge image, mmap'ed straight from the rom file.
+ * Opening the same file again returns the same Rom, so any number of
+ * instances in a process share one mapping (and one physical copy).
+ */
+typedef struct Rom {
+	atomic_int ref_count;
+	uint8_t* data;				//Mapping, at least two banks long
+	size_t size;				//Size of the rom file
+	size_t mapped_size;			//size rounded up to whole banks
+	dev_t device;
+	ino_t inode;
+	struct Rom* next;			//Open roms in this process
+} Rom;
+
+/*
+ * Bank controller state for the inserted cartridge.
+ * Switching banks only repoints Cpu.rom_map or changes which ram bank
+ * is used, no data is ever copied.
+ */
+typedef struct Cartridge {
+	uint8_t mapper;
+	bool battery;
+	bool rumble;
+
+	uint16_t rom_bank_count;
+	uint8_t ram_bank_count;
+	MemoryPage* ram_banks[MAX_RAM_BANKS];		//RAM_BANK_SIZE each, shared copy-on-write like the rest of memory
+
+	bool ram_enabled;
+	uint16_t rom_bank;			//Switchable bank, 9 bits on MBC5
+	uint8_t upper_bits;			//MBC1 0x4000 - 0x5FFF, ram bank or rom bank bits 5-6
+	uint8_t banking_mode;		//MBC1 0x6000 - 0x7FFF
+	uint8_t ram_bank;			//MBC3 0x08 - 0x0C select an rtc register instead
+
+	uint8_t rtc[NUM_RTC_REGISTERS];
+	uint8_t latched_rtc[NUM_RTC_REGISTERS];
+	uint8_t rtc_latch;
+
+	/*
+	 * Battery backed ram mapped onto a .sav file. The ram banks stay
+	 * ordinary pages, so forks share them like any other memory, and the
+	 * banks written since the last cartridge_sync are copied into the
+	 * mapping then. Only the instance that attached the file holds it.
+	 */
+	uint8_t* save;
+	size_t save_size;
+	uint16_t save_dirty_banks;	//Bit per ram bank
+} Cartridge;
+
+struct Cpu;
+
+//Returns NULL if the file can't be opened or mapped
+Rom* rom_open(const char* path);
+Rom* rom_share(Rom* rom);
+void rom_release(Rom* rom);
+
+//Maps rom into the instance's address space and sets up the bank controller
+//named in its header. The instance takes its own reference to rom
+void load_rom(struct Cpu* cpu, Rom* rom);
+
+//Writes to 0x0000 - 0x7FFF, which go to the bank controller
+void cartridge_write(struct Cpu* cpu, uint16_t address, uint8_t value);
+
+//0xA000 - 0xBFFF
+uint8_t cartridge_read_ram(struct Cpu* cpu, uint16_t address);
+void cartridge_write_ram(struct Cpu* cpu, uint16_t address, uint8_t value);
+
+//Maps the cartridge ram onto the save file at path, creating it if needed.
+//Does nothing for carts without a battery. Returns false if the file can't be mapped
+bool attach_save_file(struct Cpu* cpu, const char* path);
+
+//Copies any save ram written since the last sync into the save file and queues
+//it to be written back to disk, called at frame boundaries. Never waits on the disk
+void cartridge_sync(struct Cpu* cpu);
+
+//The copy of a cart shares its ram copy-on-write. A save file stays with
+//the original instance, only it writes to the file
+void share_cartridge(Cartridge* cart);
+void release_cartridge(Cartridge* cart);
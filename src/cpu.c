@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -18,7 +19,7 @@ void print_cpu_contents(Cpu* cpu) {
     printf("PC: %d (0x%hX)\n", cpu->pc,  cpu->pc);
     printf("CLOCKS\n");
     printf("T: %d, M: %d\n", cpu->t, cpu->m);
-    printf("Total T: %d, Total M: %d\n", cpu->total_t, cpu->total_m);
+    printf("Total T: %" PRIu64 ", Total M: %" PRIu64 "\n", cpu->total_t, cpu->total_m);
     
 
     printf("FLAGS\n");
@@ -48,10 +49,30 @@ void reset_cpu(Cpu* cpu) {
     cpu->t = 0;
     cpu->total_m = 0;
     cpu->total_t = 0;
+    cpu->instructions = 0;
+    cpu->oam_dma = 0;
+    cpu->dma_end = 0;
+
+
+    //Nothing is read from an empty cartridge slot
+    static const uint8_t no_rom[MEMORY_PAGE_SIZE];
+    cpu->rom = NULL;
+    memset(&cpu->cart, 0, sizeof(Cartridge));
+    for (int i = 0; i < NUM_ROM_PAGES; i++)
+        cpu->rom_map[i] = no_rom;
+
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        //Rom is read through rom_map, vram is held by the gpu
+        //and cartridge ram by the cartridge
+        if (i < NUM_ROM_PAGES || i == VRAM_PAGE || i == EXTERNAL_RAM_PAGE)
+            cpu->pages[i] = NULL;
+        else
+            cpu->pages[i] = page_alloc(i == HIGH_PAGE ? HIGH_PAGE_SIZE : MEMORY_PAGE_SIZE);
+    }
 
-
-    memset(cpu->memory, 0, MEMORY_SIZE);
-
+	reset_timer(&cpu->timer, cpu->total_t);
+	reset_joypad(&cpu->joypad);
+	reset_apu(&cpu->apu);
 	write_byte(cpu, 0xFF05, 0x00);
 	write_byte(cpu, 0xFF06, 0x00);
 	write_byte(cpu, 0xFF07, 0x00);
@@ -89,10 +110,54 @@ void reset_cpu(Cpu* cpu) {
     cpu->interrupt_master_enable = true;
     cpu->interrupt_enable = 0;
     cpu->interrupt_flags = 0xE1;
-	cpu->joypad_register = 0xCF;	//bit 6,7 not used, bit 0-3 are 1 when buttons are NOT pressed
     
 }
 
+void set_profile(Cpu* cpu, Profile* profile) {
+	cpu->gpu.profile = profile;
+	cpu->apu.profile = profile;
+}
+
+Cpu* gb_fork(const Cpu* parent) {
+    Cpu* child = malloc(sizeof(Cpu));
+    if (child == NULL)
+        return NULL;
+    memcpy(child, parent, sizeof(Cpu));
+    //A fork runs on the buttons it is given, never on whatever the host is holding
+    child->joypad.source = NULL;
+
+    //Only take references here, pages get copied when the child writes to them
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        if (child->pages[i] != NULL)
+            page_share(child->pages[i]);
+    }
+    share_gpu(&child->gpu);
+    if (child->rom != NULL)
+        rom_share(child->rom);
+    share_cartridge(&child->cart);
+    share_apu(&child->apu);
+    return child;
+}
+
+void release_cpu(Cpu* cpu) {
+    for (int i = 0; i < NUM_MEMORY_PAGES; i++) {
+        page_release(cpu->pages[i]);
+        cpu->pages[i] = NULL;
+    }
+    release_gpu(&cpu->gpu);
+    release_apu(&cpu->apu);
+    release_cartridge(&cpu->cart);
+    rom_release(cpu->rom);
+    cpu->rom = NULL;
+}
+
+void gb_free(Cpu* cpu) {
+    if (cpu == NULL)
+        return;
+    release_cpu(cpu);
+    free(cpu);
+}
+
 uint16_t join_registers(uint8_t a, uint8_t b) {
     return (a << 8) | b;
 };
@@ -252,7 +317,13 @@ void push_16bit_register(Cpu* cpu, uint8_t reg1, uint8_t reg2) {
 }
 
 //Opcode groupings
+void (*unimplemented_opcode_hook)(uint8_t opcode) = NULL;
+
 void unimplemented_opcode(uint8_t opcode) {
+    if (unimplemented_opcode_hook != NULL) {
+        unimplemented_opcode_hook(opcode);
+        return;
+    }
     printf("Opcode not implemented: %hhX\n", opcode);
     exit(1);
 }
@@ -4563,8 +4634,9 @@ bool handle_interrupt(Cpu* cpu, uint8_t interrupt) {
 	switch (interrupt) {
 		case 0: cpu->pc = 0x40; vblank_occured = true; break;		//vblank
 		case 1: cpu->pc = 0x48; break;		//lcd stat
-		case 2: cpu->pc = 0x50; break;		//serial
-		case 3: cpu->pc = 0x60; break;		//joypad
+		case 2: cpu->pc = 0x50; break;		//timer
+		case 3: cpu->pc = 0x58; break;		//serial
+		case 4: cpu->pc = 0x60; break;		//joypad
 	}
 
 	return vblank_occured;
@@ -4595,7 +4667,9 @@ bool check_interrupt(Cpu* cpu) {
 
 int execute(Cpu* cpu, uint8_t opcode) {
 	if (cpu->halt) {
-	//Do nothing at the moment
+		//Nothing runs while halted, but the clock keeps going
+		cpu->m = 1;
+		cpu->t = 4;
 	} else {
 		switch (opcode) {
 			case 0x00:
@@ -5484,6 +5558,17 @@ int execute(Cpu* cpu, uint8_t opcode) {
 	}
 	uint8_t interrupts_to_set = gpu_step(&cpu->gpu, cpu->t);	
 	cpu->interrupt_flags |= interrupts_to_set;
+	//The timer only needs looking at once its next overflow is due
+	if (cpu->total_t + cpu->t >= cpu->timer.overflow_at && timer_overflow(&cpu->timer, cpu->total_t + cpu->t))
+		cpu->interrupt_flags |= TIMER_RST50;
+	//Any enabled interrupt ends a halt, even with interrupts disabled
+	if (cpu->halt && (cpu->interrupt_enable & cpu->interrupt_flags & 0x1F))
+		cpu->halt = false;
+	//Frame boundary, get battery saves on their way to disk and catch the sound up
+	if (interrupts_to_set & VBLANK_RST40) {
+		cartridge_sync(cpu);
+		apu_sync(&cpu->apu, cpu->total_t);
+	}
 	bool vblank_occured = check_interrupt(cpu);
 	cpu->total_m += cpu->m;
 	cpu->total_t += cpu->t;
@@ -5492,8 +5577,12 @@ int execute(Cpu* cpu, uint8_t opcode) {
 
 int step(Cpu* cpu)  {
 	//TODO: Maybe don't increment pc until after execute?  Would require most opcodes to be fixed (wrong pc incrementation), but would make more logical sense	
-	printf("PC:0x%02X\t", cpu->pc);
-	uint8_t opcode = read_byte(cpu, cpu->pc++);
+	//Nothing is fetched while halted
+	cpu->instructions += !cpu->halt;
+	uint8_t opcode = cpu->halt ? 0x00 : read_byte(cpu, cpu->pc++);
+	//Build with -DTRACE_CPU to log every instruction
+#ifdef TRACE_CPU
+	printf("PC:0x%02X\t", cpu->pc - 1);
 	printf("Op:0x%02hhX", opcode);
 	//uint16_t operand = read_word(cpu, cpu->pc);
 	//printf("\tOp 1st:0x%02hhX", (uint8_t)(operand >> 8));
@@ -5503,5 +5592,20 @@ int step(Cpu* cpu)  {
 	printf("\tLY: %#X", cpu->gpu.line);
 	printf("\tIE: %#X", cpu->interrupt_enable);
 	printf("\tIF: %#X\n", cpu->interrupt_flags);
+#endif
 	return execute(cpu, opcode);
 }
+
+int run_frame(Cpu* cpu) {
+	uint64_t frame_end = cpu->total_t + FULL_FRAME_CLOCKS;
+	//With the lcd on vblank always comes, frames can run a few clocks over FULL_FRAME_CLOCKS
+	while ((cpu->gpu.lcdc & 0x80) || cpu->total_t < frame_end) {
+		uint8_t mode = cpu->gpu.mode;
+		step(cpu);
+		if (mode != VBLANK && cpu->gpu.mode == VBLANK)
+			return 1;
+	}
+	//No vblank to sync the sound on with the lcd off
+	apu_sync(&cpu->apu, cpu->total_t);
+	return 0;
+}
@@ -2,8 +2,12 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "apu.h"
+#include "cartridge.h"
 #include "gpu.h"
+#include "joypad.h"
 #include "memory.h"
+#include "timer.h"
 
 struct Gpu;
 typedef struct Cpu {
@@ -13,14 +17,23 @@ typedef struct Cpu {
 	uint16_t sp, pc;               	//16 bit registers
 	uint8_t m, t;					//clocks for last instruction
 									//t increments with each clock step, m being a quarter of t
-	int total_m, total_t;
-	uint8_t memory[UINT16_MAX];		//16 bit address bus
+	uint64_t total_m, total_t;		//Clocks since reset, wide enough to never wrap
+	uint64_t instructions;			//Executed since reset, for benchmarks
+	MemoryPage* pages[NUM_MEMORY_PAGES];	//16 bit address bus, see memory.h
+	const uint8_t* rom_map[NUM_ROM_PAGES];	//Where each rom page currently reads from
+	Rom* rom;
+	Cartridge cart;
 
 	bool interrupt_master_enable;
 	uint8_t interrupt_enable;		//Bits 1-4
 	uint8_t interrupt_flags;		//Bits 1-4
 
-	uint8_t joypad_register;
+	Joypad joypad;
+	Timer timer;
+	Apu apu;
+
+	uint8_t oam_dma;				//0xFF46, high byte of the last dma source
+	uint64_t dma_end;				//total_t at which a running oam dma lets go of the bus
 
 	bool halt;
 	Gpu gpu;
@@ -71,3 +84,31 @@ void decrement_16bit_register(uint8_t* reg1, uint8_t* reg2);
 void push_16bit_register(Cpu* cpu, uint8_t reg1, uint8_t reg2);
 
 int step(Cpu* cpu);
+
+//Runs opcode as if it had just been fetched from pc - 1, operands are read from pc
+int execute(Cpu* cpu, uint8_t opcode);
+
+//Called with any opcode the cpu doesn't implement. NULL, the default, prints it and exits.
+//Lets tools that try every opcode (see bench/) carry on past them
+extern void (*unimplemented_opcode_hook)(uint8_t opcode);
+void unimplemented_opcode(uint8_t opcode);
+
+//Runs until the gpu enters vblank, or for a frame's worth of clocks when the lcd is off.
+//Returns 1 if a frame was finished
+int run_frame(Cpu* cpu);
+
+//Times parts of every frame into profile, NULL to stop. See Profile
+void set_profile(Cpu* cpu, Profile* profile);
+
+//Creates a new instance in the same state as parent. Memory is shared
+//copy-on-write, so the fork only pays for the pages it goes on to write.
+//parent must not be stepped while it is being forked, but any number of
+//threads may fork the same parent at once.
+//Returns NULL if the instance could not be allocated
+Cpu* gb_fork(const Cpu* parent);
+
+//Frees an instance returned by gb_fork
+void gb_free(Cpu* cpu);
+
+//Drops the memory held by an instance set up with reset_cpu
+void release_cpu(Cpu* cpu);
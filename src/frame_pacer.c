@@ -0,0 +1,56 @@
+#include <time.h>
+
+#include "frame_pacer.h"
+
+uint64_t pacer_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void pacer_init(FramePacer* pacer, double speed) {
+	pacer_set_speed(pacer, speed);
+	pacer->measure_start = pacer_now();
+	pacer->measure_frames = 0;
+	pacer->achieved_speed = 0;
+}
+
+void pacer_set_speed(FramePacer* pacer, double speed) {
+	pacer->speed = speed;
+	pacer->frame_time = speed > 0 ? (uint64_t)(FRAME_NANOSECONDS / speed) : 0;
+	//Start counting from now, a deadline set at the old speed could be far off
+	pacer->next_frame = pacer_now() + pacer->frame_time;
+}
+
+//Sleeps until close to the deadline, then spins the rest of the way
+static void wait_until(uint64_t deadline) {
+	uint64_t now = pacer_now();
+	if (now + PACER_SPIN_NANOSECONDS < deadline) {
+		uint64_t wake = deadline - PACER_SPIN_NANOSECONDS;
+		struct timespec sleep_until = { wake / 1000000000ull, wake % 1000000000ull };
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sleep_until, NULL);
+	}
+	while (pacer_now() < deadline)
+		;
+}
+
+bool pacer_wait(FramePacer* pacer) {
+	if (pacer->frame_time > 0) {
+		wait_until(pacer->next_frame);
+		pacer->next_frame += pacer->frame_time;
+		//After a long stall (a debugger, a suspended laptop) carry on from now
+		//rather than running flat out until the deadlines catch up
+		uint64_t now = pacer_now();
+		if (now > pacer->next_frame + PACER_MAX_LAG_FRAMES * pacer->frame_time)
+			pacer->next_frame = now + pacer->frame_time;
+	}
+
+	pacer->measure_frames++;
+	uint64_t elapsed = pacer_now() - pacer->measure_start;
+	if (elapsed < 1000000000ull)
+		return false;
+	pacer->achieved_speed = (double)pacer->measure_frames * FRAME_NANOSECONDS / elapsed;
+	pacer->measure_start += elapsed;
+	pacer->measure_frames = 0;
+	return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+//A frame is 70224 clocks of the 4194304Hz cpu clock, about 59.7275 frames a second
+#define CPU_CLOCK_HZ            4194304
+#define FRAME_NANOSECONDS       (70224 * 1000000000ull / CPU_CLOCK_HZ)
+
+//How close to a deadline the pacer stops sleeping and spins instead,
+//sleeps routinely overshoot by a fraction of a millisecond
+#define PACER_SPIN_NANOSECONDS  1000000
+
+//Falling further behind than this many frames gives up on catching up
+#define PACER_MAX_LAG_FRAMES    4
+
+/*
+ * Keeps emulation running at a multiple of the real Game Boy frame rate.
+ * Deadlines are absolute, each one a frame after the last rather than a
+ * frame after the wait returned, so oversleeping one frame is made up on
+ * the next and the rate doesn't drift.
+ */
+typedef struct FramePacer {
+	double speed;						//Multiple of real time, 0 runs unthrottled
+	uint64_t frame_time;				//Nanoseconds per frame at speed
+	uint64_t next_frame;				//Deadline for the next frame, CLOCK_MONOTONIC nanoseconds
+
+	//Achieved speed, measured over roughly a second
+	uint64_t measure_start;
+	uint32_t measure_frames;
+	double achieved_speed;
+} FramePacer;
+
+void pacer_init(FramePacer* pacer, double speed);
+
+//Takes effect from the next frame, 0 for unthrottled
+void pacer_set_speed(FramePacer* pacer, double speed);
+
+//Call once per emulated frame, waits until it is due.
+//Returns true when achieved_speed has just been updated
+bool pacer_wait(FramePacer* pacer);
+
+//CLOCK_MONOTONIC in nanoseconds
+uint64_t pacer_now(void);
@@ -1,9 +1,255 @@
+#include <pthread.h>
 #include <string.h>
 
 #include "gpu.h"
+#include "memory.h"
+
+//One byte per pixel for each byte of a decoded tile row (4 pixels, leftmost first)
+#define EXPAND(b) { ((b) >> 6) & 0x03, ((b) >> 4) & 0x03, ((b) >> 2) & 0x03, (b) & 0x03 }
+#define EXPAND4(b) EXPAND(b), EXPAND((b) + 1), EXPAND((b) + 2), EXPAND((b) + 3)
+#define EXPAND16(b) EXPAND4(b), EXPAND4((b) + 4), EXPAND4((b) + 8), EXPAND4((b) + 12)
+#define EXPAND64(b) EXPAND16(b), EXPAND16((b) + 16), EXPAND16((b) + 32), EXPAND16((b) + 48)
+static const uint8_t expand_pixels[256][4] = {
+	EXPAND64(0), EXPAND64(64), EXPAND64(128), EXPAND64(192)
+};
+
+//Default shades, lightest first
+static const uint32_t default_colour_scheme[4] = {
+	0xFFEBEBEB,
+	0xFFC4C4C4,
+	0xFF606060,
+	0xFF000000
+};
+
+/*
+ * Palette resolution for presenting the framebuffer, turns SCREEN_WIDTH
+ * shades into 4 byte pixels. palette holds the 4 byte pixel for each shade.
+ * The version to use is picked once, the first time a gpu is reset.
+ * Build with -DGPU_NO_SIMD to force the scalar version.
+ */
+typedef void (*ResolvePalette)(uint8_t* out, const uint8_t* indices, const uint32_t palette[4]);
+static ResolvePalette resolve_palette;
+static pthread_once_t resolve_palette_once = PTHREAD_ONCE_INIT;
+
+#if defined(__SSE2__) && !defined(GPU_NO_SIMD)
+#include <immintrin.h>
+
+//Compares each index against the 4 colours and keeps the matching one
+static void resolve_palette_sse2(uint8_t* out, const uint8_t* indices, const uint32_t palette[4]) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128i colours[4];
+	for (int i = 0; i < 4; i++)
+		colours[i] = _mm_set1_epi32(palette[i]);
+
+	for (int x = 0; x < SCREEN_WIDTH; x += 8) {
+		__m128i index_bytes = _mm_loadl_epi64((const __m128i*)(indices + x));
+		__m128i index_words = _mm_unpacklo_epi8(index_bytes, zero);
+		__m128i halves[2] = {
+			_mm_unpacklo_epi16(index_words, zero),
+			_mm_unpackhi_epi16(index_words, zero)
+		};
+		for (int half = 0; half < 2; half++) {
+			__m128i pixels = zero;
+			for (int i = 0; i < 4; i++) {
+				__m128i match = _mm_cmpeq_epi32(halves[half], _mm_set1_epi32(i));
+				pixels = _mm_or_si128(pixels, _mm_and_si128(match, colours[i]));
+			}
+			_mm_storeu_si128((__m128i*)(out + (x + half * 4) * 4), pixels);
+		}
+	}
+}
+
+//Uses each index to shuffle the bytes of its colour straight out of the palette
+__attribute__((target("avx2")))
+static void resolve_palette_avx2(uint8_t* out, const uint8_t* indices, const uint32_t palette[4]) {
+	const __m256i colours = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)palette));
+	//Both lanes get all 8 indices, the low lane spreads pixels 0-3 and the high lane 4-7
+	const __m256i spread = _mm256_setr_epi8(
+		0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+		4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7);
+	const __m256i byte_in_pixel = _mm256_setr_epi8(
+		0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3,
+		0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3);
+
+	for (int x = 0; x < SCREEN_WIDTH; x += 8) {
+		int64_t eight_indices;
+		memcpy(&eight_indices, indices + x, 8);
+		__m256i selected = _mm256_shuffle_epi8(_mm256_set1_epi64x(eight_indices), spread);
+		//Index * 4 + byte is the palette byte, indices are below 4 so the 16 bit shift can't carry
+		selected = _mm256_add_epi8(_mm256_slli_epi16(selected, 2), byte_in_pixel);
+		_mm256_storeu_si256((__m256i*)(out + x * 4), _mm256_shuffle_epi8(colours, selected));
+	}
+}
+
+static void pick_resolve_palette(void) {
+	resolve_palette = __builtin_cpu_supports("avx2") ? resolve_palette_avx2 : resolve_palette_sse2;
+}
+#else
+static void resolve_palette_scalar(uint8_t* out, const uint8_t* indices, const uint32_t palette[4]) {
+	for (int i = 0; i < SCREEN_WIDTH; i++)
+		memcpy(out + i * 4, &palette[indices[i]], 4);
+}
+
+static void pick_resolve_palette(void) {
+	resolve_palette = resolve_palette_scalar;
+}
+#endif
+
+//Views of the caches held in pages
+typedef uint16_t TileRows[ROWS_IN_TILE];
+
+static inline const TileRows* decoded_tiles(const Gpu* gpu) {
+	return (const TileRows*)gpu->tileset->data;
+}
+
+static inline const ShadeTables* shade_tables(const Gpu* gpu) {
+	return (const ShadeTables*)gpu->shades->data;
+}
+
+static inline const LineKey* line_keys(const Gpu* gpu) {
+	return (const LineKey*)gpu->line_keys->data;
+}
 
 void reset_gpu(Gpu* gpu) {
+	pthread_once(&resolve_palette_once, pick_resolve_palette);
     memset(gpu, 0, sizeof(Gpu));
+	set_colour_scheme(gpu, default_colour_scheme);
+	gpu->framebuffer = page_alloc(SCREEN_WIDTH * SCREEN_HEIGHT);
+	gpu->vram = page_alloc(GRAPHICS_RAM_END - GRAPHICS_RAM + 1);
+	gpu->tileset = page_alloc(NUM_OF_INDIVIDUAL_TILES * sizeof(TileRows));
+	gpu->line_keys = page_alloc(SCREEN_HEIGHT * sizeof(LineKey));
+	//Zeroed shade tables are already right for the zeroed palettes
+	gpu->shades = page_alloc(sizeof(ShadeTables));
+}
+
+void share_gpu(Gpu* gpu) {
+	gpu->profile = NULL;
+	page_share(gpu->framebuffer);
+	page_share(gpu->vram);
+	page_share(gpu->tileset);
+	page_share(gpu->line_keys);
+	page_share(gpu->shades);
+	if (gpu->background_plane != NULL)
+		page_share(gpu->background_plane);
+}
+
+void release_gpu(Gpu* gpu) {
+	page_release(gpu->framebuffer);
+	page_release(gpu->vram);
+	page_release(gpu->tileset);
+	page_release(gpu->line_keys);
+	page_release(gpu->shades);
+	page_release(gpu->background_plane);
+	gpu->framebuffer = NULL;
+	gpu->vram = NULL;
+	gpu->tileset = NULL;
+	gpu->line_keys = NULL;
+	gpu->shades = NULL;
+	gpu->background_plane = NULL;
+}
+
+void set_background_plane(Gpu* gpu, bool enabled) {
+	gpu->use_background_plane = enabled;
+	if (enabled && gpu->background_plane == NULL)
+		gpu->background_plane = page_alloc(BACKGROUND_PLANE_SIZE * BACKGROUND_PLANE_SIZE);
+	gpu->plane_valid = false;
+}
+
+static void build_palette(uint8_t shades[256][4], uint8_t palette) {
+	for (int byte = 0; byte < 256; byte++) {
+		for (int pixel = 0; pixel < 4; pixel++)
+			shades[byte][pixel] = (palette >> (expand_pixels[byte][pixel] * 2)) & 0x03;
+	}
+}
+
+void set_background_palette(Gpu* gpu, uint8_t value) {
+	gpu->background_palette = value;
+	gpu->shades_dirty = true;
+}
+
+void set_object_palette(Gpu* gpu, int palette, uint8_t value) {
+	gpu->object_palettes[palette] = value;
+	gpu->shades_dirty = true;
+}
+
+//Rebuilds the shade tables whose palette changed since they were last built
+static void update_shades(Gpu* gpu) {
+	if (!gpu->shades_dirty)
+		return;
+	ShadeTables* shades = (ShadeTables*)page_make_writable(&gpu->shades);
+	if (gpu->shades_palettes[0] != gpu->background_palette) {
+		build_palette(shades->background, gpu->background_palette);
+		gpu->shades_palettes[0] = gpu->background_palette;
+	}
+	for (int palette = 0; palette < 2; palette++) {
+		if (gpu->shades_palettes[palette + 1] != gpu->object_palettes[palette]) {
+			build_palette(shades->objects[palette], gpu->object_palettes[palette]);
+			gpu->shades_palettes[palette + 1] = gpu->object_palettes[palette];
+		}
+	}
+	gpu->shades_dirty = false;
+}
+
+void set_colour_scheme(Gpu* gpu, const uint32_t colours[4]) {
+	memcpy(gpu->colour_scheme, colours, sizeof(gpu->colour_scheme));
+}
+
+void write_vram(Gpu* gpu, uint16_t address, uint8_t value) {
+	//Rewriting the same value changes nothing, so don't copy the page or invalidate anything
+	if (gpu->vram->data[address] == value)
+		return;
+	page_make_writable(&gpu->vram)[address] = value;
+	if (address < TILE_DATA_SIZE) {
+		uint16_t tile = address >> 4;
+		gpu->dirty_tiles[tile >> 6] |= (uint64_t)1 << (tile & 63);
+		gpu->tiles_dirty = true;
+		gpu->tile_block_generation[tile >> 7]++;
+		gpu->plane_dirty_tiles[tile >> 6] |= (uint64_t)1 << (tile & 63);
+	} else {
+		uint16_t entry = address - TILE_DATA_SIZE;
+		gpu->map_row_generation[entry >> 5]++;
+		gpu->plane_dirty_entries[entry >> 6] |= (uint64_t)1 << (entry & 63);
+	}
+	gpu->plane_dirty = true;
+}
+
+//Moves bit n of a byte to bit n * 2
+static uint16_t spread_bits(uint8_t byte) {
+	uint16_t spread = byte;
+	spread = (spread | (spread << 4)) & 0x0F0F;
+	spread = (spread | (spread << 2)) & 0x3333;
+	spread = (spread | (spread << 1)) & 0x5555;
+	return spread;
+}
+
+void update_tileset(Gpu* gpu) {
+	if (!gpu->tiles_dirty)
+		return;
+	const uint8_t* vram = gpu->vram->data;
+	TileRows* tileset = (TileRows*)page_make_writable(&gpu->tileset);
+	for (int word = 0; word < NUM_OF_INDIVIDUAL_TILES / 64; word++) {
+		uint64_t dirty = gpu->dirty_tiles[word];
+		while (dirty) {
+			int tile = word * 64 + __builtin_ctzll(dirty);
+			dirty &= dirty - 1;
+			//Each row is 2 bytes, low bits of every pixel then high bits
+			const uint8_t* rows = &vram[tile * 16];
+			for (int row = 0; row < ROWS_IN_TILE; row++)
+				tileset[tile][row] = spread_bits(rows[row * 2]) | (spread_bits(rows[row * 2 + 1]) << 1);
+		}
+		gpu->dirty_tiles[word] = 0;
+	}
+	gpu->tiles_dirty = false;
+}
+
+//Screen x the window starts at on the current line, SCREEN_WIDTH if it isn't shown
+static int window_start(const Gpu* gpu) {
+	//Turning the background off hides the window as well
+	if (!CHECK_BIT(gpu->lcdc, 5) || !CHECK_BIT(gpu->lcdc, 0))
+		return SCREEN_WIDTH;
+	if (gpu->line < gpu->window_y || gpu->window_x >= SCREEN_WIDTH + 7)
+		return SCREEN_WIDTH;
+	return gpu->window_x < 7 ? 0 : gpu->window_x - 7;
 }
 
 uint8_t gpu_step(Gpu* gpu, uint8_t last_t_clock) {
@@ -14,8 +260,11 @@ uint8_t gpu_step(Gpu* gpu, uint8_t last_t_clock) {
 		switch(gpu->mode) {
 			case SCANLINE_OAM:
 				if (gpu->mode_clock >= SCANLINE_OAM_CLOCKS) {
-					gpu->mode_clock = 0;
+					//Carry the clocks past the end of the mode over so lines don't stretch
+					gpu->mode_clock -= SCANLINE_OAM_CLOCKS;
 					gpu->mode = SCANLINE_VRAM;
+					//End of the oam scan, pick this line's sprites
+					select_sprites(gpu);
 					//Clear the mode bits
 					gpu->lcd_status_register &= ~LCD_MODE_BITS;
 					//Set the mode bits
@@ -25,7 +274,7 @@ uint8_t gpu_step(Gpu* gpu, uint8_t last_t_clock) {
 			case SCANLINE_VRAM:
 				//end of this mode is end of scanline
 				if  (gpu->mode_clock >= SCANLINE_VRAM_CLOCKS) {
-					gpu->mode_clock = 0;
+					gpu->mode_clock -= SCANLINE_VRAM_CLOCKS;
 					gpu->mode = HBLANK;
 					//Clear the mode bits
 					gpu->lcd_status_register &= ~LCD_MODE_BITS;
@@ -37,12 +286,16 @@ uint8_t gpu_step(Gpu* gpu, uint8_t last_t_clock) {
 					}
 
 					//TODO: write out scanline to the framebuffer
+					uint64_t start = profile_begin(gpu->profile);
 					render_background(gpu);
+					profile_end(gpu->profile, PROFILE_RENDER, start);
+					if (window_start(gpu) < SCREEN_WIDTH)
+						gpu->window_line++;
 				}
 				break;
 			case HBLANK:
 				if (gpu->mode_clock >= HBLANK_CLOCKS) {
-					gpu->mode_clock = 0;
+					gpu->mode_clock -= HBLANK_CLOCKS;
 					gpu->line++;
 
 					if (gpu->line == MAX_DISPLAY_LINES) {
@@ -56,6 +309,9 @@ uint8_t gpu_step(Gpu* gpu, uint8_t last_t_clock) {
 							interrupts |= STAT_REG_RST48;
 						}
 						interrupts |= VBLANK_RST40;
+						gpu->last_frame_reused_lines = gpu->reused_lines;
+						gpu->reused_lines = 0;
+						gpu->window_line = 0;
 					} else {
 						gpu->mode = SCANLINE_OAM;
 						//Check if OAM interrupt is enabled
@@ -71,7 +327,7 @@ uint8_t gpu_step(Gpu* gpu, uint8_t last_t_clock) {
 				break;
 			case VBLANK:
 				if (gpu->mode_clock >= SINGLE_LINE_CLOCKS) {
-					gpu->mode_clock = 0;
+					gpu->mode_clock -= SINGLE_LINE_CLOCKS;
 					gpu->line++;
 
 					if (gpu->line > MAX_LINES) {
@@ -105,67 +361,394 @@ uint8_t gpu_step(Gpu* gpu, uint8_t last_t_clock) {
 	return interrupts;
 }
 
-void render_background(Gpu* gpu) { 
-	//Check if background is not enabled
-	if (!CHECK_BIT(gpu->lcdc, 0)) {
-		//Background is disabled, just render white
-		memset(gpu->background_pixels, 0xFF, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
-		return;
-	}
-	
-	//Set the correct address of the bg tilemap
+#ifdef GPU_CHECK_RENDERER
+#include <stdio.h>
+#include <stdlib.h>
+
+//The original pixel at a time renderer, built with -DGPU_CHECK_RENDERER
+//every line is checked against it and the first mismatch exits, see make check
+static void render_background_reference(Gpu* gpu, uint8_t* line_shades) {
+	const uint8_t* vram = gpu->vram->data;
 	uint16_t bg_tilemap_address = CHECK_BIT(gpu->lcdc, 3) ? 0x9C00 : 0x9800;
 	bg_tilemap_address -= 0x8000;
-
-	uint16_t bg_tile_address = CHECK_BIT(gpu->lcdc, 4) ? 0x8000 : 0x8800;
+	uint16_t bg_tile_address = CHECK_BIT(gpu->lcdc, 4) ? 0x8000 : 0x9000;
 	bg_tile_address -= 0x8000;
 
-	uint8_t tile_y = (((gpu->line + gpu->scroll_y) / 8) % 32);
-	uint8_t tile_y_offset = ((gpu->line + gpu->scroll_y) % 8);
+	uint16_t window_tilemap_address = CHECK_BIT(gpu->lcdc, 6) ? 0x9C00 : 0x9800;
+	window_tilemap_address -= 0x8000;
+	bool window = CHECK_BIT(gpu->lcdc, 5) && gpu->line >= gpu->window_y && gpu->window_x <= 166;
 
 	for (uint8_t i = 0; i < SCREEN_WIDTH; i++) {
-		uint8_t tile_x = (((gpu->scroll_x + i) / 8) % 32);
-		uint8_t tile_number = gpu->vram[bg_tilemap_address + (tile_y * 32) + tile_x];
+		uint8_t tilemap_x = gpu->scroll_x + i;
+		uint8_t tilemap_y = gpu->line + gpu->scroll_y;
+		uint16_t tilemap_address = bg_tilemap_address;
+		if (window && i + 7 >= gpu->window_x) {
+			tilemap_x = i + 7 - gpu->window_x;
+			tilemap_y = gpu->window_line;
+			tilemap_address = window_tilemap_address;
+		}
+		uint8_t tile_y_offset = tilemap_y % 8;
+		uint8_t tile_number = vram[tilemap_address + (tilemap_y / 8) * 32 + tilemap_x / 8];
 
 		uint16_t tile_offset = 0;
-		if (CHECK_BIT(gpu->lcdc, 4)) {
-			//Unsigned tile_number
+		if (CHECK_BIT(gpu->lcdc, 4))
 			tile_offset = bg_tile_address + tile_number * 0x10;
-		} else {
-			//Signed tile_number
+		else
 			tile_offset = bg_tile_address + (int8_t)(tile_number) * 0x10;
-		}
 		tile_offset += tile_y_offset * 2;
 
-		uint8_t first_byte = gpu->vram[tile_offset];
-		uint8_t second_byte = gpu->vram[tile_offset + 1];
+		uint8_t first_byte = vram[tile_offset];
+		uint8_t second_byte = vram[tile_offset + 1];
 
-		uint8_t bit = (7 - ((gpu->scroll_x  + i) % 8));
+		uint8_t bit = 7 - (tilemap_x % 8);
 		uint8_t palette_low_bit = CHECK_BIT(first_byte, bit) ? 0x01 : 0x00;
 		uint8_t palette_high_bit = CHECK_BIT(second_byte, bit) ? 0x02 : 0x00;
 
-		const uint8_t colours[] = {
-			0xEB,
-			0xC4,
-			0x60,
-			0x00
-		};
-
 		const uint8_t palette[] = {
-			colours[gpu->background_palette & 0x03],
-			colours[(gpu->background_palette >> 2) & 0x03],
-			colours[(gpu->background_palette >> 4) & 0x03],
-			colours[(gpu->background_palette >> 6) & 0x03]
+			gpu->background_palette & 0x03,
+			(gpu->background_palette >> 2) & 0x03,
+			(gpu->background_palette >> 4) & 0x03,
+			(gpu->background_palette >> 6) & 0x03
 		};
 
-		uint8_t colour = palette[palette_low_bit + palette_high_bit];
-		int offset = ((gpu->line * SCREEN_WIDTH) + i) * 4;
-		gpu->background_pixels[offset + 0] = 0xFF;		//A
-		//RGB
-		gpu->background_pixels[offset + 1] = colour;		
-		gpu->background_pixels[offset + 2] = colour;		
-		gpu->background_pixels[offset + 3] = colour;		
+		line_shades[i] = palette[palette_low_bit + palette_high_bit];
 	}
+}
+#endif
+
+//Writes one row of a background tile, lookup turns each byte of the decoded
+//row into 4 bytes, either shades or colour indices
+static inline void draw_tile_row(const Gpu* gpu, uint8_t* out, const uint8_t (*lookup)[4], uint8_t tile_number, uint8_t tile_y_offset) {
+	//Unsigned tile_number from 0x8000, signed from 0x9000
+	uint16_t tile_index = CHECK_BIT(gpu->lcdc, 4) ? tile_number : 256 + (int8_t)tile_number;
+	uint16_t row = decoded_tiles(gpu)[tile_index][tile_y_offset];
+	memcpy(out, lookup[row >> 8], 4);
+	memcpy(out + 4, lookup[row & 0xFF], 4);
+}
 
+static void draw_plane_entry(Gpu* gpu, uint8_t* plane, const uint8_t* tilemap, int entry) {
+	uint8_t* out = &plane[(entry / 32) * 8 * BACKGROUND_PLANE_SIZE + (entry % 32) * 8];
+	for (int row = 0; row < ROWS_IN_TILE; row++)
+		draw_tile_row(gpu, out + row * BACKGROUND_PLANE_SIZE, shade_tables(gpu)->background, tilemap[entry], row);
 }
 
+/*
+ * Brings the background plane up to date with vram and the current map,
+ * tile data select and palette. Returns false if the line should be drawn
+ * from tiles instead, which happens when the palette is changed part way
+ * through a frame, since redrawing the plane for a raster effect would
+ * cost far more than it saves.
+ */
+static bool update_background_plane(Gpu* gpu) {
+	uint8_t lcdc = gpu->lcdc & 0x18;
+	bool rebuild = !gpu->plane_valid || gpu->plane_lcdc != lcdc;
+	if (gpu->plane_palette != gpu->background_palette) {
+		if (gpu->line != 0)
+			return false;
+		rebuild = true;
+	}
+	if (!rebuild && !gpu->plane_dirty)
+		return true;
+
+	uint8_t* plane = page_make_writable(&gpu->background_plane);
+	int map_base = CHECK_BIT(lcdc, 3) ? TILEMAP_SIZE : 0;
+	const uint8_t* tilemap = &gpu->vram->data[TILE_DATA_SIZE + map_base];
+	bool any_tiles_dirty = false;
+	for (int word = 0; word < NUM_OF_INDIVIDUAL_TILES / 64; word++)
+		any_tiles_dirty |= gpu->plane_dirty_tiles[word] != 0;
+
+	if (rebuild || any_tiles_dirty) {
+		//Any entry could be using a changed tile, so check them all
+		for (int entry = 0; entry < TILEMAP_SIZE; entry++) {
+			int map_entry = map_base + entry;
+			uint8_t tile_number = tilemap[entry];
+			uint16_t tile_index = CHECK_BIT(lcdc, 4) ? tile_number : 256 + (int8_t)tile_number;
+			if (rebuild
+					|| (gpu->plane_dirty_entries[map_entry >> 6] & ((uint64_t)1 << (map_entry & 63)))
+					|| (gpu->plane_dirty_tiles[tile_index >> 6] & ((uint64_t)1 << (tile_index & 63))))
+				draw_plane_entry(gpu, plane, tilemap, entry);
+		}
+	} else {
+		//Only map entries changed
+		for (int word = map_base / 64; word < (map_base + TILEMAP_SIZE) / 64; word++) {
+			uint64_t dirty = gpu->plane_dirty_entries[word];
+			while (dirty) {
+				draw_plane_entry(gpu, plane, tilemap, word * 64 + __builtin_ctzll(dirty) - map_base);
+				dirty &= dirty - 1;
+			}
+		}
+	}
+
+	//Changes to the other map don't need tracking, selecting it redraws the whole plane
+	memset(gpu->plane_dirty_tiles, 0, sizeof(gpu->plane_dirty_tiles));
+	memset(gpu->plane_dirty_entries, 0, sizeof(gpu->plane_dirty_entries));
+	gpu->plane_dirty = false;
+	gpu->plane_valid = true;
+	gpu->plane_lcdc = lcdc;
+	gpu->plane_palette = gpu->background_palette;
+	return true;
+}
+
+//Draws count pixels of a tilemap row, starting map_x pixels into it.
+//Whole tiles from the one map_x lands in, the first (map_x % 8) pixels get skipped
+static void draw_map_span(const Gpu* gpu, uint8_t* out, const uint8_t* tilemap_row, uint8_t map_x,
+		uint8_t tile_y_offset, int count, const uint8_t (*lookup)[4]) {
+	if (count <= 0)
+		return;
+	uint8_t line[SCREEN_WIDTH + 16];
+	uint8_t first_tile_x = map_x / 8;
+	int tiles = (map_x % 8 + count + 7) / 8;
+	for (int tile = 0; tile < tiles; tile++)
+		draw_tile_row(gpu, &line[tile * 8], lookup, tilemap_row[(first_tile_x + tile) % 32], tile_y_offset);
+	memcpy(out, &line[map_x % 8], count);
+}
+
+//Draws the first count pixels of the current line from the background map
+static void draw_background_span(const Gpu* gpu, uint8_t* out, int count, const uint8_t (*lookup)[4]) {
+	uint8_t y = gpu->line + gpu->scroll_y;
+	//Set the correct address of the bg tilemap
+	uint16_t bg_tilemap_address = CHECK_BIT(gpu->lcdc, 3) ? 0x9C00 : 0x9800;
+	bg_tilemap_address -= 0x8000;
+	const uint8_t* tilemap_row = &gpu->vram->data[bg_tilemap_address + (y / 8) * 32];
+	draw_map_span(gpu, out, tilemap_row, gpu->scroll_x, y % 8, count, lookup);
+}
+
+//Draws the current line from start on out of the window map.
+//The window isn't drawn over the background, the line just switches to it
+static void draw_window_span(const Gpu* gpu, uint8_t* out, int start, const uint8_t (*lookup)[4]) {
+	uint16_t window_tilemap_address = CHECK_BIT(gpu->lcdc, 6) ? 0x9C00 : 0x9800;
+	window_tilemap_address -= 0x8000;
+	const uint8_t* tilemap_row = &gpu->vram->data[window_tilemap_address + (gpu->window_line / 8) * 32];
+	//With wx below 7 the left edge of the window is off screen
+	uint8_t window_x = gpu->window_x < 7 ? 7 - gpu->window_x : 0;
+	draw_map_span(gpu, &out[start], tilemap_row, window_x, gpu->window_line % 8, SCREEN_WIDTH - start, lookup);
+}
+
+//Draws the background and window parts of the current line as shades.
+//The palette is folded into the background shade table, so each half of a tile row
+//becomes 4 shades with a single lookup
+static void draw_background_line(Gpu* gpu, uint8_t* line_shades) {
+	//Check if background is not enabled
+	if (!CHECK_BIT(gpu->lcdc, 0)) {
+		//Background is disabled, just render white
+		memset(line_shades, 0, SCREEN_WIDTH);
+		return;
+	}
+
+	int window_x = window_start(gpu);
+	if (window_x > 0 && gpu->use_background_plane && update_background_plane(gpu)) {
+		//Wraps around the right edge of the plane at most once
+		uint8_t y = gpu->line + gpu->scroll_y;
+		const uint8_t* plane_row = &gpu->background_plane->data[y * BACKGROUND_PLANE_SIZE];
+		int first_part = BACKGROUND_PLANE_SIZE - gpu->scroll_x;
+		if (first_part >= window_x) {
+			memcpy(line_shades, &plane_row[gpu->scroll_x], window_x);
+		} else {
+			memcpy(line_shades, &plane_row[gpu->scroll_x], first_part);
+			memcpy(&line_shades[first_part], plane_row, window_x - first_part);
+		}
+	} else {
+		draw_background_span(gpu, line_shades, window_x, shade_tables(gpu)->background);
+	}
+	draw_window_span(gpu, line_shades, window_x, shade_tables(gpu)->background);
+}
+
+//Marks every pixel of the current background line that has colour 0 with 0xFF,
+//sprites behind the background only show through those
+static void draw_background_zero_mask(const Gpu* gpu, uint8_t* mask) {
+	if (!CHECK_BIT(gpu->lcdc, 0)) {
+		memset(mask, 0xFF, SCREEN_WIDTH);
+		return;
+	}
+	uint8_t indices[SCREEN_WIDTH];
+	int window_x = window_start(gpu);
+	draw_background_span(gpu, indices, window_x, expand_pixels);
+	draw_window_span(gpu, indices, window_x, expand_pixels);
+	for (int i = 0; i < SCREEN_WIDTH; i++)
+		mask[i] = indices[i] ? 0x00 : 0xFF;
+}
+
+void select_sprites(Gpu* gpu) {
+	int height = CHECK_BIT(gpu->lcdc, 2) ? 16 : 8;
+	gpu->line_sprite_count = 0;
+	for (int sprite = 0; sprite < NUM_SPRITES; sprite++) {
+		int top = gpu->oam[sprite * 4] - 16;
+		if (gpu->line < top || gpu->line >= top + height)
+			continue;
+
+		//Keep them sorted by priority, lower x first then lower oam index
+		int slot = gpu->line_sprite_count++;
+		uint8_t x = gpu->oam[sprite * 4 + 1];
+		while (slot > 0 && gpu->oam[gpu->line_sprites[slot - 1] * 4 + 1] > x) {
+			gpu->line_sprites[slot] = gpu->line_sprites[slot - 1];
+			slot--;
+		}
+		gpu->line_sprites[slot] = sprite;
+		if (gpu->line_sprite_count == MAX_SPRITES_PER_LINE)
+			break;
+	}
+}
+
+//Reverses the order of the 8 pixels in a decoded tile row
+static uint16_t flip_row(uint16_t row) {
+	row = ((row & 0x3333) << 2) | ((row >> 2) & 0x3333);
+	row = ((row & 0x0F0F) << 4) | ((row >> 4) & 0x0F0F);
+	return (row << 8) | (row >> 8);
+}
+
+/*
+ * Composites the sprites picked by select_sprites over the line, 8 pixels
+ * at a time. Each sprite row becomes 8 shades plus an 8 byte mask of its
+ * non-zero pixels, which is then blended in as one 64 bit word.
+ */
+static void draw_sprites(Gpu* gpu, uint8_t* line_shades) {
+	if (!CHECK_BIT(gpu->lcdc, 1) || gpu->line_sprite_count == 0)
+		return;
+
+	//8 pixels either side so sprites hanging off the edges need no clipping
+	uint8_t line[8 + SCREEN_WIDTH + 8];
+	uint8_t background_zero[8 + SCREEN_WIDTH + 8];
+	uint8_t background[8 + SCREEN_WIDTH + 8];
+	bool have_background_zero = false;
+	memset(line, 0, sizeof(line));
+	memcpy(&line[8], line_shades, SCREEN_WIDTH);
+	memcpy(background, line, sizeof(line));
+
+	int height = CHECK_BIT(gpu->lcdc, 2) ? 16 : 8;
+	//Lowest priority first so higher priority sprites end up on top
+	for (int i = gpu->line_sprite_count - 1; i >= 0; i--) {
+		const uint8_t* sprite = &gpu->oam[gpu->line_sprites[i] * 4];
+		uint8_t x = sprite[1];
+		uint8_t attributes = sprite[3];
+		if (x == 0 || x >= SCREEN_WIDTH + 8)
+			continue;
+
+		int sprite_y = gpu->line - (sprite[0] - 16);
+		if (CHECK_BIT(attributes, 6))
+			sprite_y = height - 1 - sprite_y;
+		uint8_t tile = height == 16 ? (sprite[2] & 0xFE) + (sprite_y >> 3) : sprite[2];
+		uint16_t row = decoded_tiles(gpu)[tile][sprite_y & 0x07];
+		if (CHECK_BIT(attributes, 5))
+			row = flip_row(row);
+
+		uint64_t shades;
+		const uint8_t (*palette)[4] = shade_tables(gpu)->objects[CHECK_BIT(attributes, 4) ? 1 : 0];
+		memcpy(&shades, palette[row >> 8], 4);
+		memcpy((uint8_t*)&shades + 4, palette[row & 0xFF], 4);
+
+		uint64_t indices;
+		memcpy(&indices, expand_pixels[row >> 8], 4);
+		memcpy((uint8_t*)&indices + 4, expand_pixels[row & 0xFF], 4);
+		//0xFF in every byte whose colour index isn't 0
+		uint64_t mask = ((indices | (indices >> 1)) & 0x0101010101010101) * 0xFF;
+
+		//A sprite behind the background still hides lower priority sprites,
+		//wherever the background isn't colour 0 it puts the background back
+		if (CHECK_BIT(attributes, 7)) {
+			if (!have_background_zero) {
+				memset(background_zero, 0xFF, sizeof(background_zero));
+				draw_background_zero_mask(gpu, &background_zero[8]);
+				have_background_zero = true;
+			}
+			uint64_t zero, behind;
+			memcpy(&zero, &background_zero[x], 8);
+			memcpy(&behind, &background[x], 8);
+			shades = (shades & zero) | (behind & ~zero);
+		}
+
+		uint64_t pixels;
+		memcpy(&pixels, &line[x], 8);
+		pixels = (pixels & ~mask) | (shades & mask);
+		memcpy(&line[x], &pixels, 8);
+	}
+	memcpy(line_shades, &line[8], SCREEN_WIDTH);
+}
+
+//Hash of the oam entries of the sprites on the current line
+static uint32_t sprite_hash(const Gpu* gpu) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < gpu->line_sprite_count; i++) {
+		for (int byte = 0; byte < 4; byte++) {
+			hash ^= gpu->oam[gpu->line_sprites[i] * 4 + byte];
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+void render_background(Gpu* gpu) { 
+	uint8_t y = gpu->line + gpu->scroll_y;
+	//Map select picks which 32 rows of map_row_generation the line reads
+	int map_row = (CHECK_BIT(gpu->lcdc, 3) ? TILEMAP_ROWS : 0) + y / 8;
+
+	//Unsigned tile numbers use blocks 0 and 1, signed use 2 and 1
+	LineKey key;
+	memset(&key, 0, sizeof(key));
+	key.valid = true;
+	key.lcdc = gpu->lcdc;
+	key.scroll_x = gpu->scroll_x;
+	key.y = y;
+	key.background_palette = gpu->background_palette;
+	key.map_row_generation = gpu->map_row_generation[map_row];
+	key.tile_generations[0] = gpu->tile_block_generation[CHECK_BIT(gpu->lcdc, 4) ? 0 : 2];
+	key.tile_generations[1] = gpu->tile_block_generation[1];
+	if (CHECK_BIT(gpu->lcdc, 1) && gpu->line_sprite_count > 0) {
+		//Sprites always use blocks 0 and 1
+		key.sprite_count = gpu->line_sprite_count;
+		key.object_palettes[0] = gpu->object_palettes[0];
+		key.object_palettes[1] = gpu->object_palettes[1];
+		key.sprite_hash = sprite_hash(gpu);
+		key.sprite_tile_generation = gpu->tile_block_generation[0];
+	}
+	if (window_start(gpu) < SCREEN_WIDTH) {
+		key.window = true;
+		key.window_x = gpu->window_x;
+		key.window_line = gpu->window_line;
+		key.window_map_row_generation = gpu->map_row_generation[(CHECK_BIT(gpu->lcdc, 6) ? TILEMAP_ROWS : 0) + gpu->window_line / 8];
+	}
+	bool reused = memcmp(&key, &line_keys(gpu)[gpu->line], sizeof(key)) == 0;
+	if (reused) {
+		gpu->reused_lines++;
+#ifndef GPU_CHECK_RENDERER
+		return;
+#endif
+	}
+	memcpy(&((LineKey*)page_make_writable(&gpu->line_keys))[gpu->line], &key, sizeof(key));
+
+#ifdef GPU_CHECK_RENDERER
+	uint8_t previous[SCREEN_WIDTH];
+	memcpy(previous, &gpu->framebuffer->data[gpu->line * SCREEN_WIDTH], SCREEN_WIDTH);
+#endif
+
+	//Only once the line is known to change, so a fork on a still screen keeps sharing the framebuffer
+	uint8_t* line_shades = &page_make_writable(&gpu->framebuffer)[gpu->line * SCREEN_WIDTH];
+	update_shades(gpu);
+	update_tileset(gpu);
+	draw_background_line(gpu, line_shades);
+
+#ifdef GPU_CHECK_RENDERER
+	uint8_t expected[SCREEN_WIDTH];
+	if (CHECK_BIT(gpu->lcdc, 0)) {
+		render_background_reference(gpu, expected);
+		if (memcmp(expected, line_shades, sizeof(expected)) != 0) {
+			printf("Renderer mismatch on line %d (scx %d scy %d lcdc %#X)\n", gpu->line, gpu->scroll_x, gpu->scroll_y, gpu->lcdc);
+			exit(1);
+		}
+	}
+#endif
+
+	draw_sprites(gpu, line_shades);
+
+#ifdef GPU_CHECK_RENDERER
+	if (reused && memcmp(previous, line_shades, SCREEN_WIDTH) != 0) {
+		printf("Reused line %d differs from a fresh render\n", gpu->line);
+		exit(1);
+	}
+#endif
+}
+
+void convert_framebuffer(const Gpu* gpu, uint8_t* pixels, int pitch) {
+	const uint8_t* shades = gpu->framebuffer->data;
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
+		resolve_palette(pixels + y * pitch, shades + y * SCREEN_WIDTH, gpu->colour_scheme);
+}
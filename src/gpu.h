@@ -1,5 +1,9 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
+
+#include "page.h"
+#include "profile.h"
 #define CHECK_BIT(var, pos) ((var) & (1 << (pos)))
 #define CLEAR_BIT(var, pos) ((var) &= ~((1) << (pos)))
 
@@ -9,18 +13,93 @@
 #define MAX_DISPLAY_LINES 144				//Amount of lines shown before vblank state is entered
 #define MAX_LINES 153						//Max lines including vblank period
 #define ROWS_IN_TILE 8                      //Each row of a tile is 8 pixels
-#define NUM_OF_INDIVIDUAL_TILES 348         //2 tilesets of 256 tiles, but half of each tileset is shared
+#define NUM_OF_INDIVIDUAL_TILES 384         //2 tilesets of 256 tiles, but half of each tileset is shared
+#define TILE_DATA_SIZE          0x1800      //0x8000 - 0x97FF, 16 bytes per tile
 #define LCD_MODE_BITS		0x03
 #define LCD_COINCIDENCE_BIT	0x04
 
+#define NUM_SPRITES             40
+#define MAX_SPRITES_PER_LINE    10
+#define OAM_SIZE                0xA0        //0xFE00 - 0xFE9F, 4 bytes per sprite
+#define TILEMAP_ROWS            32
+#define TILEMAP_SIZE            0x400       //32 x 32 tile numbers
+#define BACKGROUND_PLANE_SIZE   256
+
+//Everything a background line depends on, see Gpu.line_keys
+typedef struct LineKey {
+	bool valid;
+	uint8_t lcdc;
+	uint8_t scroll_x;
+	uint8_t y;							//line + scroll_y
+	uint8_t background_palette;
+	uint32_t map_row_generation;
+	uint32_t tile_generations[2];		//The two 128 tile blocks the line can use
+	//Only set when the line has sprites
+	uint8_t sprite_count;
+	uint8_t object_palettes[2];
+	uint32_t sprite_hash;
+	uint32_t sprite_tile_generation;
+	//Only set when the window is on the line
+	bool window;
+	uint8_t window_x;
+	uint8_t window_line;
+	uint32_t window_map_row_generation;
+} LineKey;
+
+//Shade of each pixel in every byte of a decoded tile row, see Gpu.shades
+typedef struct ShadeTables {
+	uint8_t background[256][4];
+	uint8_t objects[2][256][4];
+} ShadeTables;
+
 typedef struct Gpu {
     uint8_t mode;
     int mode_clock;
     uint8_t line; 
 	uint8_t line_y_compare;
-    uint16_t tileset[NUM_OF_INDIVIDUAL_TILES][ROWS_IN_TILE];
+	/*
+	 * Tiles decoded from vram, one 2 bits per pixel row each.
+	 * The leftmost pixel is in the top 2 bits, so pixel x of a row
+	 * is (row >> (14 - x * 2)) & 0x03.
+	 * Rewritten lazily from dirty_tiles before a line is rendered.
+	 * NUM_OF_INDIVIDUAL_TILES x ROWS_IN_TILE uint16_t, held as a page
+	 * like the caches below so a fork only copies the ones it changes.
+	 */
+	MemoryPage* tileset;
+	uint64_t dirty_tiles[NUM_OF_INDIVIDUAL_TILES / 64];
+	bool tiles_dirty;
+
+	/*
+	 * Scanline reuse. Every change to tile data bumps the generation of
+	 * its 128 tile block and every change to the tilemaps bumps the
+	 * generation of its 32 tile row. A line whose key matches the one it
+	 * was last drawn with would come out identical, so it is skipped.
+	 */
+	uint32_t tile_block_generation[NUM_OF_INDIVIDUAL_TILES / 128];
+	uint32_t map_row_generation[TILEMAP_ROWS * 2];
+	MemoryPage* line_keys;				//SCREEN_HEIGHT LineKeys
+	int reused_lines;					//Lines skipped so far this frame
+	int last_frame_reused_lines;
+
+	/*
+	 * Background plane mode, see set_background_plane.
+	 * The whole 256x256 background is kept drawn (as shades) and only the
+	 * map entries whose tile number or tile data changed are redrawn,
+	 * so a line is one or two copies out of the plane.
+	 */
+	bool use_background_plane;
+	bool plane_valid;
+	uint8_t plane_lcdc;					//Map and tile data select the plane was drawn with
+	uint8_t plane_palette;
+	MemoryPage* background_plane;		//BACKGROUND_PLANE_SIZE * BACKGROUND_PLANE_SIZE shades
+	uint64_t plane_dirty_tiles[NUM_OF_INDIVIDUAL_TILES / 64];
+	uint64_t plane_dirty_entries[TILEMAP_SIZE * 2 / 64];
+	bool plane_dirty;
 	uint8_t scroll_y;
 	uint8_t scroll_x;
+	uint8_t window_y;					//0xFF4A
+	uint8_t window_x;					//0xFF4B, screen x + 7
+	uint8_t window_line;				//Next row of the window to draw, only moves on lines that show it
 
 	/*
  	 * 0xFF40 LCD Control Register (LCDC) Bits
@@ -46,11 +125,40 @@ typedef struct Gpu {
 	 * Bit 6	- LYC=LY Coincidence interrupt		(1 = Enable)
  	 */
 	uint8_t lcd_status_register;
-	uint8_t background_palette;
+	uint8_t background_palette;			//0xFF47
+	uint8_t object_palettes[2];			//0xFF48, 0xFF49
 
-	uint8_t background_pixels[SCREEN_WIDTH * SCREEN_HEIGHT * 4];		//4 for ABGR
+	/*
+	 * The palettes above applied to every byte of a decoded tile row
+	 * (4 pixels), giving the shade of each pixel. Palette writes only set
+	 * shades_dirty, the tables are rebuilt before the next line is drawn,
+	 * so a game changing palettes many times a line pays for it once.
+	 */
+	MemoryPage* shades;					//ShadeTables
+	uint8_t shades_palettes[3];			//Background then object palettes the tables were built from
+	bool shades_dirty;
+
+	//Pixel for each of the 4 shades, ARGB8888 in host byte order.
+	//Only applied when the framebuffer is converted for display
+	uint32_t colour_scheme[4];
+
+	//Both held as pages so forked instances share them until they diverge
+	MemoryPage* framebuffer;			//SCREEN_WIDTH * SCREEN_HEIGHT shades (0-3), one byte each
+	MemoryPage* vram;					//0x8000 - 0x9FFF
 
-	uint8_t vram[0x1FFF];		//Temp for now (maybe permanent)
+	/*
+	 * Sprite attributes, 4 bytes each
+	 * Byte 0 - Y + 16
+	 * Byte 1 - X + 8
+	 * Byte 2 - Tile number (from 0x8000)
+	 * Byte 3 - Bit 4: palette, bit 5: x flip, bit 6: y flip,
+	 *          bit 7: behind background colours 1-3
+	 */
+	uint8_t oam[OAM_SIZE];
+	uint8_t line_sprites[MAX_SPRITES_PER_LINE];	//Picked by select_sprites, highest priority first
+	uint8_t line_sprite_count;
+
+	Profile* profile;					//See set_profile
 } Gpu;
 
 enum GpuModes {
@@ -76,8 +184,37 @@ enum GpuInterrupts {
 
 void reset_gpu(Gpu* gpu);
 
+//Adds a holder to the memory of a gpu that was just copied from another
+void share_gpu(Gpu* gpu);
+void release_gpu(Gpu* gpu);
+
 //Processes timings and modes for gpu
 //Returns a number which is used to set interrupts
 uint8_t gpu_step(Gpu* gpu, uint8_t last_t_clock);
 
+//Writes to the palette registers, the cached shades are rebuilt when the next line is drawn
+void set_background_palette(Gpu* gpu, uint8_t value);
+void set_object_palette(Gpu* gpu, int palette, uint8_t value);
+
+//Replaces the 4 shades with user colours (ARGB8888), lightest first
+void set_colour_scheme(Gpu* gpu, const uint32_t colours[4]);
+
+//Turns the shades in the framebuffer into ARGB8888 pixels for display or capture,
+//pitch is the number of bytes between the start of each output row
+void convert_framebuffer(const Gpu* gpu, uint8_t* pixels, int pitch);
+
+//Writes to 0x8000 - 0x9FFF, address is relative to 0x8000
+void write_vram(Gpu* gpu, uint16_t address, uint8_t value);
+
+//Re-decodes any tiles written since the last call
+void update_tileset(Gpu* gpu);
+
+//Switches between drawing every line from tiles and copying it out of a
+//pre-drawn background plane, which suits games that scroll a lot
+void set_background_plane(Gpu* gpu, bool enabled);
+
+//Picks the (up to 10) sprites on the current line, done once per line during the oam scan
+void select_sprites(Gpu* gpu);
+
+//Draws the current line, background and window then sprites
 void render_background(Gpu* gpu);
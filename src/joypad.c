@@ -0,0 +1,42 @@
+#include <stddef.h>
+
+#include "joypad.h"
+
+void reset_joypad(Joypad* joypad) {
+	joypad->select = 0x30;
+	joypad->buttons = 0;
+	joypad->source = NULL;
+}
+
+uint8_t joypad_read(const Joypad* joypad) {
+	//Bits 6-7 aren't used and read as 1, keys read 0 when held
+	uint8_t keys = 0x0F;
+	if (!(joypad->select & 0x10))
+		keys &= ~(joypad->buttons & 0x0F);
+	if (!(joypad->select & 0x20))
+		keys &= ~(joypad->buttons >> 4);
+	return 0xC0 | joypad->select | keys;
+}
+
+//True if any of bits 0-3 went from 1 to 0
+static bool falling_edge(uint8_t before, uint8_t after) {
+	return (before & ~after & 0x0F) != 0;
+}
+
+bool joypad_write(Joypad* joypad, uint8_t value) {
+	uint8_t before = joypad_read(joypad);
+	joypad->select = value & 0x30;
+	return falling_edge(before, joypad_read(joypad));
+}
+
+bool joypad_set_buttons(Joypad* joypad, uint8_t buttons) {
+	uint8_t before = joypad_read(joypad);
+	joypad->buttons = buttons;
+	return falling_edge(before, joypad_read(joypad));
+}
+
+bool joypad_poll(Joypad* joypad) {
+	if (joypad->source == NULL)
+		return false;
+	return joypad_set_buttons(joypad, atomic_load_explicit(joypad->source, memory_order_relaxed));
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JOYPAD_REGISTER             0xFF00
+#define JOYPAD_RST60                0x10    //Interrupt flag bit
+
+//Held buttons, as passed to joypad_set_buttons
+enum JoypadButtons {
+	JOYPAD_RIGHT = 0x01,
+	JOYPAD_LEFT = 0x02,
+	JOYPAD_UP = 0x04,
+	JOYPAD_DOWN = 0x08,
+	JOYPAD_A = 0x10,
+	JOYPAD_B = 0x20,
+	JOYPAD_SELECT = 0x40,
+	JOYPAD_START = 0x80
+};
+
+/*
+ * 0xFF00. Bits 4 and 5 are written to select the direction keys and the
+ * other buttons, a 0 selects. Bits 0-3 read 0 for each held key on any
+ * selected row. The interrupt is requested when one of those bits goes
+ * from 1 to 0, either from a press or from selecting a row with a key
+ * already held.
+ * Nothing is polled per instruction. The host's buttons are handed over
+ * once a frame, and when source is set they are also picked up from it
+ * whenever the game reads 0xFF00, so a press gets in as soon as the game
+ * looks for it.
+ */
+typedef struct Joypad {
+	uint8_t select;					//Bits 4-5 as last written
+	uint8_t buttons;				//JoypadButtons held
+	const atomic_uint* source;		//Host's JoypadButtons, written from another thread. NULL to only take them per frame
+} Joypad;
+
+void reset_joypad(Joypad* joypad);
+
+//Functions that change what can be read return true if that should request the interrupt
+uint8_t joypad_read(const Joypad* joypad);
+bool joypad_write(Joypad* joypad, uint8_t value);
+bool joypad_set_buttons(Joypad* joypad, uint8_t buttons);
+
+//Picks up the buttons from source, if there is one
+bool joypad_poll(Joypad* joypad);
@@ -1,17 +1,149 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 #include "cpu.h"
 #include "memory.h"
 #include "gpu.h"
 
-void render(SDL_Renderer* renderer, SDL_Texture* texture, Cpu* cpu) {
+#include "audio_capture.h"
+#include "audio_ring.h"
+#include "frame_pacer.h"
+#include "movie.h"
+#include "triple_buffer.h"
+
+#define FRAME_PITCH (SCREEN_WIDTH * 4)
+
+#define AUDIO_DEVICE_FRAMES 1024		//Asked of SDL per callback
+#define AUDIO_RING_FRAMES   8192
+
+//Shared between the main (display) thread and the emulation thread
+typedef struct Emulator {
+	Cpu* cpu;
+	TripleBuffer frames;				//ARGB8888 frames, FRAME_PITCH bytes per row
+	AudioRing audio;
+	bool audio_enabled;					//False if no audio device could be opened
+	AudioCapture* capture;				//NULL unless capturing audio to a file
+	bool headless;						//No window, frames aren't converted
+	uint64_t frame_limit;				//Stops after this many frames, 0 for no limit
+	atomic_uint buttons;				//JoypadButtons held on the host, written by the main thread
+	Movie* record;						//Input is recorded into this when set
+	const Movie* replay;				//Input comes from this instead of the host when set
+	uint64_t frame_hash;				//Of every frame's shades, to compare runs of the same movie
+	uint64_t frame_count;				//Frames run so far
+	atomic_bool running;
+	double speed;						//See FramePacer.speed
+} Emulator;
+
+//Runs the cpu on its own thread so a slow or vsync blocked present never holds it up
+static void* emulate(void* data) {
+	Emulator* emulator = data;
+	FramePacer pacer;
+	pacer_init(&pacer, emulator->speed);
+	while (atomic_load_explicit(&emulator->running, memory_order_relaxed)) {
+		uint8_t buttons;
+		if (emulator->replay != NULL) {
+			if (emulator->frame_count == emulator->replay->frame_count)
+				break;
+			buttons = emulator->replay->inputs[emulator->frame_count];
+		} else {
+			buttons = atomic_load_explicit(&emulator->buttons, memory_order_relaxed);
+		}
+		if (emulator->record != NULL)
+			movie_record_frame(emulator->record, buttons);
+
+		//Once a frame, so a game halted waiting on the joypad interrupt gets it without reading 0xFF00
+		Cpu* cpu = emulator->cpu;
+		if (joypad_set_buttons(&cpu->joypad, buttons))
+			cpu->interrupt_flags |= JOYPAD_RST60;
+		run_frame(cpu);
+		emulator->frame_hash = fnv1a_64(emulator->frame_hash, cpu->gpu.framebuffer->data, SCREEN_WIDTH * SCREEN_HEIGHT);
+		if (!emulator->headless) {
+			convert_framebuffer(&emulator->cpu->gpu, triple_buffer_back(&emulator->frames), FRAME_PITCH);
+			triple_buffer_publish(&emulator->frames);
+		}
+		//Always drained, so the apu isn't left dropping old samples when there is no device
+		int16_t samples[1024 * 2];
+		int count;
+		while ((count = apu_read_samples(&emulator->cpu->apu, samples, 1024)) > 0) {
+			if (emulator->audio_enabled)
+				audio_ring_write(&emulator->audio, samples, count);
+			if (emulator->capture != NULL)
+				audio_capture_write(emulator->capture, samples, count);
+		}
+		if (++emulator->frame_count == emulator->frame_limit)
+			break;
+		if (pacer_wait(&pacer))
+			printf("Speed: %.1f%% (%.2f fps)\n", pacer.achieved_speed * 100, pacer.achieved_speed * 1e9 / FRAME_NANOSECONDS);
+	}
+	atomic_store(&emulator->running, false);
+	return NULL;
+}
+
+//Saves the movie being recorded, or reports how the replay went
+static void finish_movie(Emulator* emulator, const char* record_path) {
+	if (emulator->record != NULL) {
+		if (movie_save(emulator->record, record_path))
+			printf("Recorded %u frames to %s, frame hash %016" PRIx64 "\n", emulator->record->frame_count, record_path, emulator->frame_hash);
+		else
+			printf("Could not write movie %s\n", record_path);
+		movie_free(emulator->record);
+	}
+	if (emulator->replay != NULL) {
+		printf("Replayed %" PRIu64 " of %u frames, frame hash %016" PRIx64 "\n", emulator->frame_count, emulator->replay->frame_count, emulator->frame_hash);
+		movie_free((Movie*)emulator->replay);
+	}
+}
+
+static uint8_t key_to_button(SDL_Keycode key) {
+	switch (key) {
+		case SDLK_RIGHT: return JOYPAD_RIGHT;
+		case SDLK_LEFT: return JOYPAD_LEFT;
+		case SDLK_UP: return JOYPAD_UP;
+		case SDLK_DOWN: return JOYPAD_DOWN;
+		case SDLK_x: return JOYPAD_A;
+		case SDLK_z: return JOYPAD_B;
+		case SDLK_BACKSPACE:
+		case SDLK_RSHIFT: return JOYPAD_SELECT;
+		case SDLK_RETURN: return JOYPAD_START;
+	}
+	return 0;
+}
+
+//Runs on SDL's audio thread, only ever touches the ring
+static void audio_callback(void* data, Uint8* stream, int length) {
+	audio_ring_read(data, (int16_t*)stream, length / (int)(2 * sizeof(int16_t)));
+}
+
+static void print_usage(const char* program) {
+	printf("Usage: %s [options] [rom]\n", program);
+	printf("Keys: arrows, X = A, Z = B, Enter = Start, Backspace/Right Shift = Select, Escape quits\n");
+	printf("  --speed N    Run at N times normal speed\n");
+	printf("  --turbo      Run as fast as possible\n");
+	printf("  --headless   Run without a window or sound, best with --frames\n");
+	printf("  --frames N   Stop after N frames\n");
+	printf("  --record FILE\n");
+	printf("               Record input to a movie, from power on\n");
+	printf("  --replay FILE\n");
+	printf("               Play a movie back instead of taking input, stopping at its end.\n");
+	printf("               Prints a hash of every frame, identical for every run of a movie\n");
+	printf("  --capture-audio FILE\n");
+	printf("               Write the sound to FILE, WAV if it ends in .wav, otherwise raw\n");
+	printf("               16 bit little endian stereo at %d Hz\n", APU_SAMPLE_RATE);
+}
+
+void render(SDL_Renderer* renderer, SDL_Texture* texture, const uint8_t* frame) {
 	SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
 	SDL_RenderClear(renderer);
 	uint8_t* pixels;
 	int pitch = 0;
 	SDL_LockTexture(texture, NULL, (void**)&pixels, &pitch);
 	
-	memcpy(pixels, cpu->gpu.background_pixels, 160 * 144 * 4);
+	for (int y = 0; y < SCREEN_HEIGHT; y++)
+		memcpy(pixels + y * pitch, frame + y * FRAME_PITCH, FRAME_PITCH);
 
 	SDL_UnlockTexture(texture);
 
@@ -21,32 +153,120 @@ void render(SDL_Renderer* renderer, SDL_Texture* texture, Cpu* cpu) {
 }
 
 int main(int argc, char** argv) {
+    const char* rom_path = NULL;
+    double speed = 1;
+    bool headless = false;
+    uint64_t frame_limit = 0;
+    const char* capture_path = NULL;
+    const char* record_path = NULL;
+    const char* replay_path = NULL;
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--turbo") == 0) {
+            speed = 0;
+        } else if (strcmp(argv[arg], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[arg], "--frames") == 0 && arg + 1 < argc) {
+            frame_limit = strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--capture-audio") == 0 && arg + 1 < argc) {
+            capture_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--record") == 0 && arg + 1 < argc) {
+            record_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--replay") == 0 && arg + 1 < argc) {
+            replay_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--speed") == 0 && arg + 1 < argc) {
+            speed = atof(argv[++arg]);
+            if (speed <= 0) {
+                printf("Speed must be above 0\n");
+                return 1;
+            }
+        } else if (argv[arg][0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            rom_path = argv[arg];
+        }
+    }
+    if (record_path != NULL && replay_path != NULL) {
+        printf("Can't record and replay at once\n");
+        return 1;
+    }
+    Movie movie;
+    if (replay_path != NULL && !movie_load(&movie, replay_path))
+        return 1;
+
     Cpu cpu;
     reset_cpu(&cpu);
 
-    if (argc == 2) {
+    if (rom_path != NULL) {
         //Load rom
-        FILE* rom = fopen(argv[1], "r");
+        Rom* rom = rom_open(rom_path);
         if (rom == NULL) {
-            printf("Could not open %s\n", argv[1]);
+            printf("Could not open %s\n", rom_path);
             return 1;
         } 
-        fseek(rom, 0, SEEK_END);
-        long filelength = ftell(rom);
-        rewind(rom);
-        printf("filelength %ld\n", filelength);
-        fread(cpu.memory, filelength, 1, rom);
-        fclose(rom);
+        printf("filelength %zu\n", rom->size);
+        load_rom(&cpu, rom);
+        rom_release(rom);
+
+        //Battery saves sit next to the rom, game.gb -> game.sav
+        char save_path[4096];
+        snprintf(save_path, sizeof(save_path), "%s", rom_path);
+        char* extension = strrchr(save_path, '.');
+        if (extension != NULL && strchr(extension, '/') == NULL)
+            *extension = '\0';
+        strncat(save_path, ".sav", sizeof(save_path) - strlen(save_path) - 1);
+        //A replay starts from the ram stored in the movie and mustn't touch the real save
+        if (replay_path == NULL && !attach_save_file(&cpu, save_path))
+            printf("Could not open save file %s, saves will be lost on exit\n", save_path);
     }
     
     //execution stats at 0x100
     cpu.pc = 0x100;
+
+	Emulator emulator;
+	emulator.cpu = &cpu;
+	emulator.speed = speed;
+	emulator.headless = headless;
+	emulator.frame_limit = frame_limit;
+	emulator.audio_enabled = false;
+	emulator.capture = NULL;
+	emulator.record = NULL;
+	emulator.replay = NULL;
+	emulator.frame_hash = FNV1A_64_INIT;
+	emulator.frame_count = 0;
+	atomic_init(&emulator.running, true);
+	atomic_init(&emulator.buttons, 0);
+	if (replay_path != NULL) {
+		if (!movie_start(&movie, &cpu))
+			return 1;
+		emulator.replay = &movie;
+	} else if (record_path != NULL) {
+		movie_begin(&movie, &cpu);
+		emulator.record = &movie;
+	}
+	if (capture_path != NULL) {
+		emulator.capture = audio_capture_open(capture_path, APU_SAMPLE_RATE);
+		if (emulator.capture == NULL) {
+			printf("Could not create %s\n", capture_path);
+			return 1;
+		}
+	}
+
+	if (headless) {
+		emulate(&emulator);
+		if (emulator.capture != NULL && !audio_capture_close(emulator.capture))
+			printf("Could not write all of %s\n", capture_path);
+		finish_movie(&emulator, record_path);
+		release_cpu(&cpu);
+		return 0;
+	}
+
 	int window_scale = 5;
 	SDL_Window* window = NULL;
 	SDL_Texture* texture = NULL;
 	SDL_Renderer* renderer = NULL;
 	
-	if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
 		printf("SDL could not initalize. SDL Error: %s\n", SDL_GetError());
 		//return 1;
 	}
@@ -66,16 +286,74 @@ int main(int argc, char** argv) {
 	for (uint32_t i = 0; i < info.num_texture_formats; i++) {
 		printf("%d\n", info.texture_formats[i]);
 	}
-	int i = 0;
-	while (i < 500000) {
-		int val = step(&cpu);
-		if (val == 1) {
-			printf("vblank render now\n");
-			render(renderer, texture, &cpu);
+	triple_buffer_init(&emulator.frames, FRAME_PITCH * SCREEN_HEIGHT);
+	//Input can only be recorded or replayed a frame at a time, otherwise pick it up as late as possible
+	if (emulator.record == NULL && emulator.replay == NULL)
+		cpu.joypad.source = &emulator.buttons;
+
+	SDL_AudioSpec wanted, obtained;
+	SDL_zero(wanted);
+	wanted.freq = APU_SAMPLE_RATE;
+	wanted.format = AUDIO_S16SYS;
+	wanted.channels = 2;
+	wanted.samples = AUDIO_DEVICE_FRAMES;
+	wanted.callback = audio_callback;
+	wanted.userdata = &emulator.audio;
+	SDL_AudioDeviceID audio_device = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+	emulator.audio_enabled = audio_device != 0;
+	if (emulator.audio_enabled) {
+		//Keep two device buffers queued, enough to ride out a late frame
+		audio_ring_init(&emulator.audio, AUDIO_RING_FRAMES, obtained.samples * 2, APU_SAMPLE_RATE, obtained.freq);
+	} else {
+		printf("Could not open audio device, SDL_Error %s\n", SDL_GetError());
+	}
+	pthread_t emulation_thread;
+	if (pthread_create(&emulation_thread, NULL, emulate, &emulator) != 0) {
+		printf("Could not start emulation thread\n");
+		return 1;
+	}
+	if (emulator.audio_enabled)
+		SDL_PauseAudioDevice(audio_device, 0);
+
+	//Only presents and takes input here, a frame is picked up whenever the emulation thread has finished one
+	uint8_t buttons = 0;
+	while (atomic_load_explicit(&emulator.running, memory_order_relaxed)) {
+		SDL_Event event;
+		while (SDL_PollEvent(&event)) {
+			if (event.type == SDL_QUIT) {
+				atomic_store(&emulator.running, false);
+			} else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE) {
+				atomic_store(&emulator.running, false);
+			} else if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && !event.key.repeat) {
+				uint8_t button = key_to_button(event.key.keysym.sym);
+				if (event.type == SDL_KEYDOWN)
+					buttons |= button;
+				else
+					buttons &= ~button;
+				atomic_store_explicit(&emulator.buttons, buttons, memory_order_relaxed);
+			}
 		}
-		//i++;	
+		const uint8_t* frame = triple_buffer_acquire(&emulator.frames);
+		if (frame != NULL)
+			render(renderer, texture, frame);
+		else
+			SDL_Delay(1);
+	}
+	pthread_join(emulation_thread, NULL);
+
+	if (emulator.audio_enabled) {
+		SDL_CloseAudioDevice(audio_device);
+		audio_ring_free(&emulator.audio);
 	}
-	SDL_Delay(2000);
+	if (emulator.capture != NULL && !audio_capture_close(emulator.capture))
+		printf("Could not write all of %s\n", capture_path);
+	finish_movie(&emulator, record_path);
+	triple_buffer_free(&emulator.frames);
+	release_cpu(&cpu);
+	SDL_DestroyTexture(texture);
+	SDL_DestroyRenderer(renderer);
+	SDL_DestroyWindow(window);
+	SDL_Quit();
 
     return 0;
 }
@@ -1,7 +1,31 @@
+#include <string.h>
+
 #include "cpu.h"
 #include "memory.h"
 
+//Maps an address outside of vram onto the page holding it and the offset into that page
+static MemoryPage** page_for_address(Cpu* cpu, uint16_t address, uint16_t* offset) {
+	//Shadow ram mirrors working ram
+	if (address >= WORKING_RAM_SHADOW && address <= WORKING_RAM_SHADOW_END)
+		address -= WORKING_RAM_SHADOW - WORKING_RAM;
+
+	if (address >= SPRITE_INFO) {
+		*offset = address - SPRITE_INFO;
+		return &cpu->pages[HIGH_PAGE];
+	}
+	*offset = address & MEMORY_PAGE_MASK;
+	return &cpu->pages[address >> MEMORY_PAGE_SHIFT];
+}
+
 uint8_t read_byte(Cpu* cpu, uint16_t address) {
+	//The bus is busy with an oam dma, only high ram can be reached
+	if (cpu->total_t < cpu->dma_end && address < ZERO_PAGE_RAM)
+		return 0xFF;
+
+	//Rom is served straight from the cartridge mapping
+	if (address < GRAPHICS_RAM)
+		return cpu->rom_map[address >> MEMORY_PAGE_SHIFT][address & MEMORY_PAGE_MASK];
+
 	if (address == INTERRUPT_FLAGS_ADDRESS)
 		return cpu->interrupt_flags;
 
@@ -9,18 +33,33 @@ uint8_t read_byte(Cpu* cpu, uint16_t address) {
 		return cpu->interrupt_enable;
 
 	if (address >= GRAPHICS_RAM && address <= GRAPHICS_RAM_END) {
-		return cpu->gpu.vram[address - 0x8000];
+		return cpu->gpu.vram->data[address - GRAPHICS_RAM];
 	}	
 
+	if (address >= EXTERNAL_CARTRIDGE_RAM && address < WORKING_RAM)
+		return cartridge_read_ram(cpu, address);
+
+	if (address >= SPRITE_INFO && address < SPRITE_INFO + OAM_SIZE)
+		return cpu->gpu.oam[address - SPRITE_INFO];
+
 	//Hardware i/o registers
 	//Check pandocs for rest
 	
 	//0xFF00 - Joypad register
-	if (address == 0xFF00) {
-		return cpu->joypad_register;
-		//return cpu->memory[address];
+	if (address == JOYPAD_REGISTER) {
+		if (joypad_poll(&cpu->joypad))
+			cpu->interrupt_flags |= JOYPAD_RST60;
+		return joypad_read(&cpu->joypad);
 	}
 	
+	//0xFF04 - 0xFF07 - Timer
+	if (address >= TIMER_DIV && address <= TIMER_TAC) {
+		return timer_read(&cpu->timer, cpu->total_t, address);
+	}
+	//0xFF10 - 0xFF3F - Sound
+	if (address >= NR10 && address < WAVE_RAM + 0x10) {
+		return apu_read(&cpu->apu, cpu->total_t, address);
+	}
 	//0xFF40 - LCD and GPU control
 	if (address == 0xFF40) {
 		return cpu->gpu.lcdc;	
@@ -45,36 +84,95 @@ uint8_t read_byte(Cpu* cpu, uint16_t address) {
 	if (address == 0xFF45) {
 		return cpu->gpu.line_y_compare;
 	}
-	return cpu->memory[address];
+	//0xFF47 - BG Palette
+	if (address == 0xFF47) {
+		return cpu->gpu.background_palette;
+	}
+	//0xFF48, 0xFF49 - Object palettes
+	if (address == 0xFF48 || address == 0xFF49) {
+		return cpu->gpu.object_palettes[address - 0xFF48];
+	}
+	//0xFF46 - OAM DMA
+	if (address == 0xFF46) {
+		return cpu->oam_dma;
+	}
+	//0xFF4A - Window Y
+	if (address == 0xFF4A) {
+		return cpu->gpu.window_y;
+	}
+	//0xFF4B - Window X
+	if (address == 0xFF4B) {
+		return cpu->gpu.window_x;
+	}
+	uint16_t offset;
+	return (*page_for_address(cpu, address, &offset))->data[offset];
 }
 
 uint16_t read_word(Cpu* cpu, uint16_t address) {
     return read_byte(cpu, address) + (read_byte(cpu, address + 1) << 8);
 }
 
+/*
+ * Copies 160 bytes from value * 0x100 into oam. The copy is done at once
+ * rather than a byte per m-cycle, the rest of the transfer is only felt as
+ * the bus being locked until Cpu.dma_end
+ */
+static void start_oam_dma(Cpu* cpu, uint8_t value) {
+	cpu->oam_dma = value;
+	uint16_t source = value << 8;
+	//0xE000 and up read working ram through its shadow
+	if (source >= WORKING_RAM_SHADOW)
+		source -= WORKING_RAM_SHADOW - WORKING_RAM;
+
+	//160 bytes from a multiple of 0x100 never cross into another page
+	const uint8_t* data = NULL;
+	if (source < GRAPHICS_RAM)
+		data = &cpu->rom_map[source >> MEMORY_PAGE_SHIFT][source & MEMORY_PAGE_MASK];
+	else if (source <= GRAPHICS_RAM_END)
+		data = &cpu->gpu.vram->data[source - GRAPHICS_RAM];
+	else if (source >= WORKING_RAM)
+		data = &cpu->pages[WORKING_RAM_PAGE]->data[source - WORKING_RAM];
+
+	if (data != NULL) {
+		memcpy(cpu->gpu.oam, data, OAM_SIZE);
+	} else {
+		//Cartridge ram can be disabled or banked to an rtc register
+		for (int i = 0; i < OAM_SIZE; i++)
+			cpu->gpu.oam[i] = cartridge_read_ram(cpu, source + i);
+	}
+	cpu->dma_end = cpu->total_t + OAM_DMA_CLOCKS;
+}
+
 void write_byte(Cpu* cpu, uint16_t address, uint8_t value) {
-    if (address >= WORKING_RAM && address <= WORKING_RAM_END) {
-		cpu->memory[address] = value;
-        //write to shadow working ram as well
-        address = (address - WORKING_RAM) + WORKING_RAM_SHADOW;
-        if (address < WORKING_RAM_SHADOW_END)
-            cpu->memory[address] = value;
+	//The bus is busy with an oam dma, only high ram can be reached
+	if (cpu->total_t < cpu->dma_end && address < ZERO_PAGE_RAM)
 		return;
 
-    }
+	//Rom is read only, writes go to the bank controller
+	if (address < GRAPHICS_RAM) {
+		cartridge_write(cpu, address, value);
+		return;
+	}
 
 	if (address >= GRAPHICS_RAM && address <= GRAPHICS_RAM_END) {
-		cpu->gpu.vram[address - 0x8000] = value;
+		write_vram(&cpu->gpu, address - GRAPHICS_RAM, value);
 		return;
 	}	
 
+	if (address >= EXTERNAL_CARTRIDGE_RAM && address < WORKING_RAM) {
+		cartridge_write_ram(cpu, address, value);
+		return;
+	}
+
+	if (address >= SPRITE_INFO && address < SPRITE_INFO + OAM_SIZE) {
+		cpu->gpu.oam[address - SPRITE_INFO] = value;
+		return;
+	}
+
 	//0xFF00 - Joypad register
-	if (address == 0xFF00) {
-		cpu->joypad_register = value;
-		//Set bottom bits for now since we have no joypad
-		cpu->joypad_register |= 0xF;
-		//set top 2 bits cause they're set anyway
-		cpu->joypad_register |= 0xC0;
+	if (address == JOYPAD_REGISTER) {
+		if (joypad_write(&cpu->joypad, value))
+			cpu->interrupt_flags |= JOYPAD_RST60;
 		return;
 	}
 
@@ -83,6 +181,16 @@ void write_byte(Cpu* cpu, uint16_t address, uint8_t value) {
 		cpu->interrupt_flags = value;
 		return;
 	}
+	//0xFF04 - 0xFF07 - Timer
+	if (address >= TIMER_DIV && address <= TIMER_TAC) {
+		timer_write(&cpu->timer, cpu->total_t, address, value);
+		return;
+	}
+	//0xFF10 - 0xFF3F - Sound
+	if (address >= NR10 && address < WAVE_RAM + 0x10) {
+		apu_write(&cpu->apu, cpu->total_t, address, value);
+		return;
+	}
 	//0xFF40 - LCDC
 	if (address == 0xFF40) {
 		cpu->gpu.lcdc = value;
@@ -90,9 +198,10 @@ void write_byte(Cpu* cpu, uint16_t address, uint8_t value) {
 		if (!(cpu->gpu.lcdc & 0x80)) {
 			//LCD off, reset line
 			cpu->gpu.line = 0;
+			cpu->gpu.window_line = 0;
 			//Set display to white
 			//TODO: Shouldn't be handled here
-			//memset(cpu->gpu.background_pixels, 0xFF, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+			//memset(cpu->gpu.framebuffer->data, 0, SCREEN_WIDTH * SCREEN_HEIGHT);
 			cpu->gpu.mode = SCANLINE_OAM;
 			cpu->gpu.mode_clock = 0;
 		}
@@ -120,14 +229,36 @@ void write_byte(Cpu* cpu, uint16_t address, uint8_t value) {
 	}
 	//0xFF47 - BG Palette
 	if (address == 0xFF47)  {
-		cpu->gpu.background_palette = value;	
+		set_background_palette(&cpu->gpu, value);
+		return;
+	}
+	//0xFF48, 0xFF49 - Object palettes
+	if (address == 0xFF48 || address == 0xFF49) {
+		set_object_palette(&cpu->gpu, address - 0xFF48, value);
+		return;
+	}
+	//0xFF46 - OAM DMA
+	if (address == 0xFF46) {
+		start_oam_dma(cpu, value);
+		return;
+	}
+	//0xFF4A - Window Y
+	if (address == 0xFF4A) {
+		cpu->gpu.window_y = value;
+		return;
+	}
+	//0xFF4B - Window X
+	if (address == 0xFF4B) {
+		cpu->gpu.window_x = value;
 		return;
 	}
 	if (address == 0xFFFF) {
 		cpu->interrupt_enable = value;
 		return;
 	}
-    cpu->memory[address] = value;
+	//Working ram and its shadow share a page, so writes to either show up in both
+	uint16_t offset;
+	page_make_writable(page_for_address(cpu, address, &offset))[offset] = value;
 }
 
 void write_word(Cpu* cpu, uint16_t address, uint16_t value) {
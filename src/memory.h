@@ -1,7 +1,6 @@
 #pragma once
 #include <stdint.h>
 
-#include "cpu.h"
 #define CARTRIDGE_ROM_BANK_0        0x0000  //0x0000 - 0x3FFF
 #define BIOS                        0x0000  //0x0000 - 0x00FF
 #define CARTRIDGE_HEADER            0x0100  //0x0100 - 0x014F
@@ -18,6 +17,27 @@
 #define ZERO_PAGE_RAM               0xFF80  //0xFF80 - 0xFFFF
 #define MEMORY_SIZE                 0xFFFF
 
+//The address space is split into 8KB pages which forked instances share
+//until written to. 0xFE00 - 0xFFFF gets its own small page since it is
+//written constantly and copying 8KB for a stack push would be a waste
+#define MEMORY_PAGE_SHIFT           13
+#define MEMORY_PAGE_SIZE            0x2000
+#define MEMORY_PAGE_MASK            (MEMORY_PAGE_SIZE - 1)
+#define NUM_MEMORY_PAGES            8
+#define HIGH_PAGE_SIZE              0x200   //0xFE00 - 0xFFFF
+#define NUM_ROM_PAGES               4       //0x0000 - 0x7FFF, see Cpu.rom_map
+
+enum MemoryPages {
+    ROM_PAGE_0                  = 0,        //Pages 0-3 aren't used, rom is read through Cpu.rom_map
+    VRAM_PAGE                   = 4,        //Held by the gpu
+    EXTERNAL_RAM_PAGE           = 5,        //Held by the cartridge, see Cartridge.ram_banks
+    WORKING_RAM_PAGE            = 6,
+    HIGH_PAGE                   = 7         //OAM, IO and zero page
+};
+
+//Oam dma copies 160 bytes, one per m-cycle, with the cpu locked out of everything but high ram
+#define OAM_DMA_CLOCKS              640
+
 enum InterruptAddresses {
     INTERRUPT_ENABLE_ADDRESS    = 0xFFFF,
     INTERRUPT_FLAGS_ADDRESS     = 0xFF0F,   
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "movie.h"
+
+uint64_t fnv1a_64(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= FNV1A_64_PRIME;
+	}
+	return hash;
+}
+
+uint64_t rom_hash(const Rom* rom) {
+	return rom == NULL ? 0 : fnv1a_64(FNV1A_64_INIT, rom->data, rom->size);
+}
+
+static void* allocate(size_t size) {
+	void* data = malloc(size == 0 ? 1 : size);
+	if (data == NULL) {
+		printf("Could not allocate %zu bytes for movie\n", size);
+		exit(1);
+	}
+	return data;
+}
+
+void movie_begin(Movie* movie, const Cpu* cpu) {
+	const Cartridge* cart = &cpu->cart;
+	movie->rom_hash = rom_hash(cpu->rom);
+	movie->start_ram_size = cart->ram_bank_count * RAM_BANK_SIZE;
+	movie->start_ram = allocate(movie->start_ram_size);
+	for (int i = 0; i < cart->ram_bank_count; i++)
+		memcpy(movie->start_ram + i * RAM_BANK_SIZE, cart->ram_banks[i]->data, RAM_BANK_SIZE);
+	movie->frame_count = 0;
+	movie->capacity = 60 * 60;
+	movie->inputs = allocate(movie->capacity);
+}
+
+void movie_record_frame(Movie* movie, uint8_t buttons) {
+	if (movie->frame_count == movie->capacity) {
+		movie->capacity *= 2;
+		movie->inputs = realloc(movie->inputs, movie->capacity);
+		if (movie->inputs == NULL) {
+			printf("Could not allocate %u frames for movie\n", movie->capacity);
+			exit(1);
+		}
+	}
+	movie->inputs[movie->frame_count++] = buttons;
+}
+
+static void put_u32(FILE* file, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		fputc(value >> (i * 8), file);
+}
+
+static bool get_u32(FILE* file, uint32_t* value) {
+	uint8_t bytes[4];
+	if (fread(bytes, 1, 4, file) != 4)
+		return false;
+	*value = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+	return true;
+}
+
+bool movie_save(const Movie* movie, const char* path) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL)
+		return false;
+	fwrite(MOVIE_MAGIC, 1, 4, file);
+	fputc(MOVIE_VERSION, file);
+	put_u32(file, movie->rom_hash);
+	put_u32(file, movie->rom_hash >> 32);
+	put_u32(file, movie->start_ram_size);
+	fwrite(movie->start_ram, 1, movie->start_ram_size, file);
+	put_u32(file, movie->frame_count);
+
+	//Buttons are held for many frames at a time, so runs keep this to a few bytes a second
+	uint32_t frame = 0;
+	while (frame < movie->frame_count) {
+		uint8_t buttons = movie->inputs[frame];
+		uint32_t run = 1;
+		while (frame + run < movie->frame_count && movie->inputs[frame + run] == buttons)
+			run++;
+		frame += run;
+		for (; run >= 0x80; run >>= 7)
+			fputc(0x80 | (run & 0x7F), file);
+		fputc(run, file);
+		fputc(buttons, file);
+	}
+	bool ok = !ferror(file);
+	return fclose(file) == 0 && ok;
+}
+
+bool movie_load(Movie* movie, const char* path) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		printf("Could not open movie %s\n", path);
+		return false;
+	}
+	memset(movie, 0, sizeof(Movie));
+	char magic[4];
+	uint32_t hash_low, hash_high;
+	if (fread(magic, 1, 4, file) != 4 || memcmp(magic, MOVIE_MAGIC, 4) != 0 || fgetc(file) != MOVIE_VERSION) {
+		printf("%s is not a version %d movie\n", path, MOVIE_VERSION);
+		fclose(file);
+		return false;
+	}
+	if (!get_u32(file, &hash_low) || !get_u32(file, &hash_high) || !get_u32(file, &movie->start_ram_size))
+		goto truncated;
+	movie->rom_hash = hash_low | (uint64_t)hash_high << 32;
+	if (movie->start_ram_size > MAX_RAM_BANKS * RAM_BANK_SIZE)
+		goto truncated;
+	movie->start_ram = allocate(movie->start_ram_size);
+	if (fread(movie->start_ram, 1, movie->start_ram_size, file) != movie->start_ram_size || !get_u32(file, &movie->frame_count))
+		goto truncated;
+
+	//inputs grows as the runs are read instead of trusting frame_count up front,
+	//so a damaged count runs out of file rather than asking for gigabytes
+	movie->capacity = movie->frame_count < 60 * 60 ? movie->frame_count : 60 * 60;
+	movie->inputs = allocate(movie->capacity);
+	uint32_t frame = 0;
+	while (frame < movie->frame_count) {
+		uint32_t run = 0;
+		int byte;
+		for (int shift = 0; shift < 32; shift += 7) {
+			byte = fgetc(file);
+			if (byte == EOF)
+				goto truncated;
+			run |= (uint32_t)(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+				break;
+		}
+		int buttons = fgetc(file);
+		if (buttons == EOF || run == 0 || run > movie->frame_count - frame)
+			goto truncated;
+		if (frame + run > movie->capacity) {
+			uint64_t capacity = (uint64_t)movie->capacity * 2;
+			if (capacity < frame + run)
+				capacity = frame + run;
+			if (capacity > movie->frame_count)
+				capacity = movie->frame_count;
+			uint8_t* inputs = realloc(movie->inputs, capacity);
+			if (inputs == NULL) {
+				printf("Could not allocate %u frames for movie %s\n", movie->frame_count, path);
+				goto failed;
+			}
+			movie->inputs = inputs;
+			movie->capacity = capacity;
+		}
+		memset(movie->inputs + frame, buttons, run);
+		frame += run;
+	}
+	fclose(file);
+	return true;
+
+truncated:
+	printf("Movie %s is damaged\n", path);
+failed:
+	fclose(file);
+	movie_free(movie);
+	return false;
+}
+
+bool movie_start(const Movie* movie, Cpu* cpu) {
+	if (rom_hash(cpu->rom) != movie->rom_hash) {
+		printf("Movie was recorded with a different rom (%016llx, this is %016llx)\n",
+			(unsigned long long)movie->rom_hash, (unsigned long long)rom_hash(cpu->rom));
+		return false;
+	}
+	Cartridge* cart = &cpu->cart;
+	if (movie->start_ram_size != cart->ram_bank_count * RAM_BANK_SIZE) {
+		printf("Movie has %u bytes of cartridge ram, the cartridge has %d\n", movie->start_ram_size, cart->ram_bank_count * RAM_BANK_SIZE);
+		return false;
+	}
+	for (int i = 0; i < cart->ram_bank_count; i++)
+		memcpy(page_make_writable(&cart->ram_banks[i]), movie->start_ram + i * RAM_BANK_SIZE, RAM_BANK_SIZE);
+	return true;
+}
+
+void movie_free(Movie* movie) {
+	free(movie->start_ram);
+	free(movie->inputs);
+	movie->start_ram = NULL;
+	movie->inputs = NULL;
+	movie->frame_count = 0;
+	movie->capacity = 0;
+}
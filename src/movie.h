@@ -0,0 +1,53 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cartridge.h"
+
+#define MOVIE_MAGIC                 "GBMV"
+#define MOVIE_VERSION               1
+
+#define FNV1A_64_INIT               0xCBF29CE484222325ull
+#define FNV1A_64_PRIME              0x100000001B3ull
+
+struct Cpu;
+
+/*
+ * Recorded joypad input, one JoypadButtons byte per frame, replayed from
+ * power on. Everything else that decides how a run goes is stored with
+ * it: a hash of the rom, so a movie isn't played against the wrong game,
+ * and the cartridge ram as it was when recording started. The emulation
+ * itself is deterministic, so the same movie always gives the same
+ * frames and sound.
+ *
+ * On disk, all little endian:
+ *     "GBMV", version (1 byte), rom hash (8)
+ *     cartridge ram size (4), cartridge ram
+ *     frame count (4), then runs of (frame count as LEB128, buttons (1))
+ */
+typedef struct Movie {
+	uint64_t rom_hash;
+	uint8_t* start_ram;
+	uint32_t start_ram_size;
+	uint8_t* inputs;				//JoypadButtons for each frame
+	uint32_t frame_count;
+	uint32_t capacity;
+} Movie;
+
+uint64_t fnv1a_64(uint64_t hash, const void* data, size_t size);
+uint64_t rom_hash(const Rom* rom);
+
+//Starts recording from cpu, which should have just been reset with its rom loaded
+void movie_begin(Movie* movie, const struct Cpu* cpu);
+void movie_record_frame(Movie* movie, uint8_t buttons);
+bool movie_save(const Movie* movie, const char* path);
+
+//Prints why and returns false if the file can't be read
+bool movie_load(Movie* movie, const char* path);
+
+//Puts a freshly reset cpu with its rom loaded into the movie's start state.
+//Prints why and returns false if the movie is for a different rom
+bool movie_start(const Movie* movie, struct Cpu* cpu);
+
+void movie_free(Movie* movie);
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "page.h"
+
+MemoryPage* page_alloc(size_t size) {
+	MemoryPage* page = calloc(1, sizeof(MemoryPage) + size);
+	if (page == NULL) {
+		printf("Could not allocate memory page of %zu bytes\n", size);
+		exit(1);
+	}
+	atomic_init(&page->ref_count, 1);
+	page->size = size;
+	return page;
+}
+
+MemoryPage* page_copy(const MemoryPage* page) {
+	MemoryPage* copy = malloc(sizeof(MemoryPage) + page->size);
+	if (copy == NULL) {
+		printf("Could not allocate memory page of %zu bytes\n", page->size);
+		exit(1);
+	}
+	atomic_init(&copy->ref_count, 1);
+	copy->size = page->size;
+	memcpy(copy->data, page->data, page->size);
+	return copy;
+}
+
+MemoryPage* page_share(MemoryPage* page) {
+	atomic_fetch_add_explicit(&page->ref_count, 1, memory_order_relaxed);
+	return page;
+}
+
+void page_release(MemoryPage* page) {
+	if (page == NULL)
+		return;
+	if (atomic_fetch_sub_explicit(&page->ref_count, 1, memory_order_acq_rel) == 1)
+		free(page);
+}
+
+uint8_t* page_make_writable(MemoryPage** page) {
+	MemoryPage* shared = *page;
+	//Sole holder, nobody else can see the write
+	if (atomic_load_explicit(&shared->ref_count, memory_order_acquire) == 1)
+		return shared->data;
+
+	MemoryPage* copy = page_copy(shared);
+
+	//Another holder may have copied at the same time, whoever drops
+	//the last reference frees the original
+	page_release(shared);
+	*page = copy;
+	return copy->data;
+}
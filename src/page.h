@@ -0,0 +1,35 @@
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Reference counted block of emulated memory.
+ * Forked instances (see gb_fork) share their pages with the parent and
+ * only take a private copy the first time they write to a shared page,
+ * so a fork costs a handful of pointer copies until it actually diverges.
+ *
+ * Pages may be shared and released from any thread, but a single Cpu
+ * (and so a single page holder) must only be used by one thread at a time.
+ */
+typedef struct MemoryPage {
+	atomic_int ref_count;
+	size_t size;
+	uint8_t data[];
+} MemoryPage;
+
+//Returns a zeroed page with a reference count of 1, exits if out of memory
+MemoryPage* page_alloc(size_t size);
+
+//Returns a private copy of page with a reference count of 1
+MemoryPage* page_copy(const MemoryPage* page);
+
+//Adds a holder to page and returns it
+MemoryPage* page_share(MemoryPage* page);
+
+//Drops a holder from page, freeing it once nobody holds it
+void page_release(MemoryPage* page);
+
+//Makes sure the caller is the only holder of *page, copying it if it isn't
+//Returns the data that is now safe to write to
+uint8_t* page_make_writable(MemoryPage** page);
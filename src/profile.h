@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+enum ProfileSections {
+	PROFILE_RENDER,					//render_background, once per visible line
+	PROFILE_APU,					//apu_sync, running the channels and filtering
+	NUM_PROFILE_SECTIONS
+};
+
+/*
+ * Where the time goes, for benchmarks. Only the few calls that happen per
+ * line or per frame are timed, anything per instruction would cost more
+ * than it measures, so the cpu's share is whatever is left of the total.
+ * Instances carry a NULL profile unless one is attached with set_profile,
+ * which costs a single untaken branch at each timed call.
+ */
+typedef struct Profile {
+	uint64_t nanoseconds[NUM_PROFILE_SECTIONS];
+	uint64_t calls[NUM_PROFILE_SECTIONS];
+} Profile;
+
+static inline uint64_t profile_begin(const Profile* profile) {
+	if (profile == NULL)
+		return 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static inline void profile_end(Profile* profile, int section, uint64_t start) {
+	if (profile == NULL)
+		return;
+	profile->nanoseconds[section] += profile_begin(profile) - start;
+	profile->calls[section]++;
+}
@@ -0,0 +1,91 @@
+#include "timer.h"
+
+//TIMA counts falling edges of bit 9, 3, 5 or 7 of the divider counter,
+//so it goes up once every this many clocks, picked by TAC bits 0-1
+static const uint64_t tima_periods[4] = { 1024, 16, 64, 256 };
+
+//Divider counter after boot
+#define DIV_COUNTER_AT_BOOT 0xABCC
+
+static uint64_t divider_counter(const Timer* timer, uint64_t now) {
+	return now + timer->div_offset;
+}
+
+//Adds the increments since tima_time, never enough to overflow as the
+//overflow itself is handled by timer_overflow first
+static void sync_tima(Timer* timer, uint64_t now) {
+	if (timer->tac & 0x04) {
+		uint64_t period = tima_periods[timer->tac & 0x03];
+		uint64_t ticks = divider_counter(timer, now) / period - divider_counter(timer, timer->tima_time) / period;
+		timer->tima += ticks;
+	}
+	timer->tima_time = now;
+}
+
+static void schedule_overflow(Timer* timer) {
+	if (!(timer->tac & 0x04)) {
+		timer->overflow_at = TIMER_NEVER;
+		return;
+	}
+	uint64_t period = tima_periods[timer->tac & 0x03];
+	uint64_t ticks = divider_counter(timer, timer->tima_time) / period + (256 - timer->tima);
+	timer->overflow_at = ticks * period - timer->div_offset;
+}
+
+void reset_timer(Timer* timer, uint64_t now) {
+	timer->div_offset = DIV_COUNTER_AT_BOOT - now;
+	timer->tima = 0;
+	timer->tima_time = now;
+	timer->tma = 0;
+	timer->tac = 0;
+	timer->overflow_at = TIMER_NEVER;
+}
+
+uint8_t timer_read(Timer* timer, uint64_t now, uint16_t address) {
+	switch (address) {
+		case TIMER_DIV:
+			return divider_counter(timer, now) >> 8;
+		case TIMER_TIMA:
+			sync_tima(timer, now);
+			return timer->tima;
+		case TIMER_TMA:
+			return timer->tma;
+		case TIMER_TAC:
+			//Unused bits read as 1
+			return timer->tac | 0xF8;
+	}
+	return 0xFF;
+}
+
+void timer_write(Timer* timer, uint64_t now, uint16_t address, uint8_t value) {
+	//Count up to now under the old settings
+	sync_tima(timer, now);
+	switch (address) {
+		case TIMER_DIV:
+			//Any write resets the whole counter
+			timer->div_offset = 0 - now;
+			break;
+		case TIMER_TIMA:
+			timer->tima = value;
+			break;
+		case TIMER_TMA:
+			timer->tma = value;
+			break;
+		case TIMER_TAC:
+			timer->tac = value & 0x07;
+			break;
+	}
+	schedule_overflow(timer);
+}
+
+bool timer_overflow(Timer* timer, uint64_t now) {
+	if (now < timer->overflow_at)
+		return false;
+	//With a high TMA and the fastest frequency it can overflow more than once an instruction
+	while (timer->overflow_at <= now) {
+		timer->tima = timer->tma;
+		timer->tima_time = timer->overflow_at;
+		schedule_overflow(timer);
+	}
+	return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TIMER_DIV                   0xFF04
+#define TIMER_TIMA                  0xFF05
+#define TIMER_TMA                   0xFF06
+#define TIMER_TAC                   0xFF07
+
+#define TIMER_RST50                 0x04    //Interrupt flag bit
+#define TIMER_NEVER                 UINT64_MAX
+
+/*
+ * DIV, TIMA, TMA and TAC.
+ * Nothing here is ticked per instruction. DIV is the top byte of a
+ * counter worked out from the cpu's clock count when it is read, and TIMA
+ * is only brought up to date when it is read or written. The clock count
+ * its next overflow falls on is worked out in advance, so the cpu only
+ * has to compare its clock against overflow_at.
+ */
+typedef struct Timer {
+	uint64_t div_offset;		//Added to the clock count gives the divider counter, DIV is bits 8-15
+	uint8_t tima;				//0xFF05, as of tima_time
+	uint64_t tima_time;
+	uint8_t tma;				//0xFF06
+	uint8_t tac;				//0xFF07, bit 2 enable, bits 0-1 frequency
+	uint64_t overflow_at;		//Clock count TIMA next overflows at, TIMER_NEVER when stopped
+} Timer;
+
+//now is the cpu's clock count, Cpu.total_t
+void reset_timer(Timer* timer, uint64_t now);
+
+uint8_t timer_read(Timer* timer, uint64_t now, uint16_t address);
+void timer_write(Timer* timer, uint64_t now, uint16_t address, uint8_t value);
+
+//Handles every overflow due by now, reloading TIMA from TMA.
+//Returns true if any happened and the interrupt should be requested
+bool timer_overflow(Timer* timer, uint64_t now);
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "triple_buffer.h"
+
+void triple_buffer_init(TripleBuffer* triple, size_t size) {
+	for (int i = 0; i < 3; i++) {
+		triple->buffers[i] = calloc(1, size);
+		if (triple->buffers[i] == NULL) {
+			printf("Could not allocate frame buffer of %zu bytes\n", size);
+			exit(1);
+		}
+	}
+	triple->size = size;
+	triple->back = 0;
+	triple->front = 1;
+	atomic_init(&triple->middle, 2);
+}
+
+void triple_buffer_free(TripleBuffer* triple) {
+	for (int i = 0; i < 3; i++) {
+		free(triple->buffers[i]);
+		triple->buffers[i] = NULL;
+	}
+}
+
+uint8_t* triple_buffer_back(TripleBuffer* triple) {
+	return triple->buffers[triple->back];
+}
+
+void triple_buffer_publish(TripleBuffer* triple) {
+	//Release so the frame is written before the consumer can see it
+	int spare = atomic_exchange_explicit(&triple->middle, triple->back | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+	triple->back = spare & ~TRIPLE_BUFFER_FRESH;
+}
+
+const uint8_t* triple_buffer_acquire(TripleBuffer* triple) {
+	if (!(atomic_load_explicit(&triple->middle, memory_order_relaxed) & TRIPLE_BUFFER_FRESH))
+		return NULL;
+	//Acquire pairs with the release in triple_buffer_publish
+	int newest = atomic_exchange_explicit(&triple->middle, triple->front, memory_order_acq_rel);
+	triple->front = newest & ~TRIPLE_BUFFER_FRESH;
+	return triple->buffers[triple->front];
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hands finished frames from one producer thread to one consumer thread
+ * without locking. The producer always has a buffer of its own to draw
+ * into and the consumer always has one to read from, the third holds the
+ * newest finished frame. Handing over is a single atomic swap with that
+ * third buffer on either side, so neither thread ever waits on the other
+ * or sees a frame that is still being written.
+ */
+typedef struct TripleBuffer {
+	uint8_t* buffers[3];
+	size_t size;
+	int back;							//Producer's buffer
+	int front;							//Consumer's buffer
+	atomic_int middle;					//Spare buffer, with TRIPLE_BUFFER_FRESH set when it holds an unseen frame
+} TripleBuffer;
+
+#define TRIPLE_BUFFER_FRESH 0x04
+
+//Allocates three zeroed buffers of size bytes, exits if out of memory
+void triple_buffer_init(TripleBuffer* triple, size_t size);
+void triple_buffer_free(TripleBuffer* triple);
+
+//Producer side. Returns the buffer to draw the next frame into
+uint8_t* triple_buffer_back(TripleBuffer* triple);
+
+//Producer side. Makes the frame drawn into the back buffer the newest one,
+//replacing it if the consumer never picked up the last
+void triple_buffer_publish(TripleBuffer* triple);
+
+//Consumer side. Returns the newest frame, or NULL if none has been published
+//since the last call. The frame stays valid until the next call
+const uint8_t* triple_buffer_acquire(TripleBuffer* triple);